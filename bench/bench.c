@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "credentials.h"
+#include "request.h"
+
+// Microbenchmarks for the request-path building blocks. None of these touch LDAP or the
+//  network, so this builds without libldap and can run anywhere.
+//
+// Usage: crappasswd_bench [--output <file>] [--baseline <file>] [--threshold <percent>] [--filter <substr>]
+//
+// Results are written as JSON (to stdout, or to --output). With --baseline, each result's
+//  fastest run is compared against the same benchmark's in a previous run's JSON, and the
+//  exit status is 1 if anything got slower by more than --threshold percent (default 15).
+//  The fastest run is what's least disturbed by the rest of the machine, so it moves far
+//  less between runs than the median does.
+
+/// Number of timed runs per benchmark; the median is reported
+#define BENCH_RUNS 7
+
+/// Target wall time for one timed run
+#define BENCH_RUN_NS 50000000ULL
+
+/// Keeps the compiler from optimizing the benchmarked calls away
+static volatile size_t sink;
+
+/// A typical email-user POST body
+static const char post_body[] =
+    "userid=jsmith&email=jsmith%40team17.devon.swccdc.com&"
+    "server=ldaps%3A%2F%2Fdc01.team17.devon.swccdc.com%2Bdc%3Dteam17%2Cdc%3Ddevon%2Cdc%3Dswccdc%2Cdc%3Dcom";
+
+/// A typical set-password query string
+static const char query_string[] =
+    "token=Qm3xYz8pLk2Jh7Vn&username=jsmith&"
+    "server=ldaps%3A%2F%2Fdc01.team17.devon.swccdc.com%2Bdc%3Dteam17%2Cdc%3Ddevon%2Cdc%3Dswccdc%2Cdc%3Dcom";
+
+/// The contents of a ".<username>" reset file, as written by email_user()
+static const char reset_file[] =
+    "Subject: Password reset\n\n"
+    "Hello jsmith,\n\n"
+    "You have requested a password reset. Please go to the following URL to reset your password:\n\n"
+    "http://crappasswd/cgi-bin/set-password?token=Qm3xYz8pLk2Jh7Vn&username=jsmith&"
+    "server=ldaps%3A%2F%2Fdc01.team17.devon.swccdc.com%2Bdc%3Dteam17%2Cdc%3Ddevon%2Cdc%3Dswccdc%2Cdc%3Dcom\n\n";
+
+static void bench_form_param_post(size_t iters)
+{
+    char body[sizeof(post_body)];
+    memcpy(body, post_body, sizeof(body));
+
+    for (size_t i = 0; i < iters; i++)
+    {
+        size_t len = 0;
+        sink += (size_t)form_param(body, "userid", &len) + len;
+        sink += (size_t)form_param(body, "email", &len) + len;
+        sink += (size_t)form_param(body, "server", &len) + len;
+    }
+}
+
+static void bench_form_param_query(size_t iters)
+{
+    char query[sizeof(query_string)];
+    memcpy(query, query_string, sizeof(query));
+
+    for (size_t i = 0; i < iters; i++)
+    {
+        size_t len = 0;
+        sink += (size_t)form_param(query, "token", &len) + len;
+        sink += (size_t)form_param(query, "username", &len) + len;
+        sink += (size_t)form_param(query, "server", &len) + len;
+    }
+}
+
+static void bench_percent_decode(size_t iters)
+{
+    size_t len = 0;
+    char body[sizeof(post_body)];
+    memcpy(body, post_body, sizeof(body));
+    const char *server = form_param(body, "server", &len);
+
+    char out[sizeof(post_body)];
+    for (size_t i = 0; i < iters; i++)
+    {
+        sink += percent_decode(out, server, len);
+    }
+}
+
+static void bench_user_filter(size_t iters)
+{
+    char filter[255];
+    for (size_t i = 0; i < iters; i++)
+    {
+        sink += user_filter(filter, sizeof(filter), "jsmith") + (size_t)filter[17];
+    }
+}
+
+static void bench_user_filter_escaped(size_t iters)
+{
+    char filter[255];
+    for (size_t i = 0; i < iters; i++)
+    {
+        sink += user_filter(filter, sizeof(filter), "j*smith)(mail=*") + (size_t)filter[17];
+    }
+}
+
+static void bench_generate_token(size_t iters)
+{
+    char token[TOKEN_LEN + 1];
+    for (size_t i = 0; i < iters; i++)
+    {
+        generate_token(token);
+        sink += (size_t)token[0];
+    }
+}
+
+static void bench_generate_password(size_t iters)
+{
+    char password[PASSWORD_LEN + 1];
+    for (size_t i = 0; i < iters; i++)
+    {
+        generate_password(password);
+        sink += (size_t)password[0];
+    }
+}
+
+static void bench_unicode_pwd_encode(size_t iters)
+{
+    uint8_t out[UNICODE_PWD_SIZE(PASSWORD_LEN)];
+    for (size_t i = 0; i < iters; i++)
+    {
+        sink += unicode_pwd_encode(out, "Qm3xYz8pLk2Jh7VnAa1!") + out[2];
+    }
+}
+
+static void bench_token_verify(size_t iters)
+{
+    for (size_t i = 0; i < iters; i++)
+    {
+        sink += (size_t)token_verify("Qm3xYz8pLk2Jh7Vn", reset_file);
+        sink += (size_t)token_verify("Qm3xYz8pLk2Jh7Vx", reset_file);
+    }
+}
+
+struct bench
+{
+    const char *name;
+    void (*fn)(size_t iters);
+};
+
+static const struct bench benches[] = {
+    {"form_param_post", bench_form_param_post},
+    {"form_param_query", bench_form_param_query},
+    {"percent_decode", bench_percent_decode},
+    {"user_filter", bench_user_filter},
+    {"user_filter_escaped", bench_user_filter_escaped},
+    {"generate_token", bench_generate_token},
+    {"generate_password", bench_generate_password},
+    {"unicode_pwd_encode", bench_unicode_pwd_encode},
+    {"token_verify", bench_token_verify},
+};
+
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+struct result
+{
+    size_t iterations;
+    double ns_per_op;
+    double min_ns_per_op;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t time_run(const struct bench *b, size_t iters)
+{
+    uint64_t start = now_ns();
+    b->fn(iters);
+    return now_ns() - start;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief Calibrate the iteration count, then time BENCH_RUNS runs of a benchmark
+static struct result run_bench(const struct bench *b)
+{
+    // Double the iteration count until a run takes long enough to scale from
+    size_t iters = 1;
+    uint64_t elapsed = time_run(b, iters);
+    while (elapsed < BENCH_RUN_NS / 10)
+    {
+        iters *= 2;
+        elapsed = time_run(b, iters);
+    }
+    iters = (size_t)((double)iters * BENCH_RUN_NS / (double)elapsed) + 1;
+
+    double ns[BENCH_RUNS];
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        ns[run] = (double)time_run(b, iters) / (double)iters;
+    }
+    qsort(ns, BENCH_RUNS, sizeof(ns[0]), compare_double);
+
+    struct result r = {
+        .iterations = iters,
+        .ns_per_op = ns[BENCH_RUNS / 2],
+        .min_ns_per_op = ns[0],
+    };
+    return r;
+}
+
+/// @brief Read a whole file into a NUL-terminated buffer
+static char *read_file(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return NULL;
+    }
+
+    size_t size = 0;
+    size_t cap = 4096;
+    char *buf = malloc(cap);
+    size_t n;
+    while (buf != NULL && (n = fread(buf + size, 1, cap - size - 1, f)) > 0)
+    {
+        size += n;
+        if (cap - size - 1 == 0)
+        {
+            cap *= 2;
+            char *grown = realloc(buf, cap);
+            if (grown == NULL)
+            {
+                free(buf);
+            }
+            buf = grown;
+        }
+    }
+    fclose(f);
+
+    if (buf != NULL)
+    {
+        buf[size] = 0;
+    }
+    return buf;
+}
+
+/// @brief Find min_ns_per_op for a benchmark in JSON written by this program
+/// @return The baseline value, or a negative number if the benchmark isn't in the baseline
+static double baseline_ns(const char *json, const char *name)
+{
+    char key[128];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+    const char *entry = strstr(json, key);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+
+    // Only look within this benchmark's own object
+    const char *end = strchr(entry, '}');
+    const char *value = strstr(entry, "\"min_ns_per_op\":");
+    if (value == NULL || (end != NULL && value > end))
+    {
+        return -1;
+    }
+    return strtod(value + strlen("\"min_ns_per_op\":"), NULL);
+}
+
+int main(int argc, char **argv)
+{
+    const char *output_path = NULL;
+    const char *baseline_path = NULL;
+    const char *filter = NULL;
+    double threshold = 15.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baseline_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+        {
+            threshold = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--output <file>] [--baseline <file>] [--threshold <percent>] [--filter <substr>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    char *baseline = NULL;
+    if (baseline_path != NULL)
+    {
+        baseline = read_file(baseline_path);
+        if (baseline == NULL)
+        {
+            fprintf(stderr, "Failed to read baseline %s\n", baseline_path);
+            return 2;
+        }
+    }
+
+    FILE *out = stdout;
+    if (output_path != NULL)
+    {
+        out = fopen(output_path, "w");
+        if (out == NULL)
+        {
+            fprintf(stderr, "Failed to open %s for writing\n", output_path);
+            return 2;
+        }
+    }
+
+    // Fixed seed so the token/password benchmarks do the same work every run
+    srand(1);
+
+    int regressions = 0;
+    int first = 1;
+
+    fprintf(out, "{\n    \"benchmarks\": [\n");
+    for (size_t i = 0; i < N_BENCHES; i++)
+    {
+        const struct bench *b = &benches[i];
+        if (filter != NULL && strstr(b->name, filter) == NULL)
+        {
+            continue;
+        }
+
+        struct result r = run_bench(b);
+
+        fprintf(out, "%s        {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f}",
+                first ? "" : ",\n", b->name, r.iterations, r.ns_per_op, r.min_ns_per_op);
+        first = 0;
+
+        if (baseline != NULL)
+        {
+            double base = baseline_ns(baseline, b->name);
+            if (base <= 0)
+            {
+                fprintf(stderr, "%-24s %10.3f ns/op min   (not in baseline)\n", b->name, r.min_ns_per_op);
+                continue;
+            }
+
+            double change = (r.min_ns_per_op - base) / base * 100.0;
+            int regressed = change > threshold;
+            regressions += regressed;
+            fprintf(stderr, "%-24s %10.3f ns/op min   baseline %10.3f   %+7.1f%%%s\n",
+                    b->name, r.min_ns_per_op, base, change, regressed ? "   REGRESSION" : "");
+        }
+    }
+    fprintf(out, "\n    ]\n}\n");
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    free(baseline);
+
+    if (regressions > 0)
+    {
+        fprintf(stderr, "%d benchmark(s) regressed by more than %.1f%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
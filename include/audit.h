@@ -0,0 +1,63 @@
+#ifndef CRAPPASSWD_AUDIT_H
+#define CRAPPASSWD_AUDIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "directory.h"
+
+// Directory-wide audit, run by hand as `crappasswd audit [<uri>+<base> ...]`. Every user entry
+//  of every domain is paged through at once (dir_scan_all()) and checked for whatever would
+//  make email-user refuse or misdirect a reset: a missing or unusable mail, a sAMAccountName
+//  the reset link can't carry, or a dn the request path can't handle. Problems are written
+//  out as soon as they're seen, one tab-separated line each:
+//
+//      <problem>\t<uri>+<base>\t<dn>\t<detail>
+//
+//  with any control characters in the fields written as \xNN, and followed by a summary in
+//  lines starting with '#'. Memory doesn't grow with the size of the directory: one page
+//  per domain, plus a fixed-size table of account names for spotting the same one in
+//  several domains.
+
+/// Only people's user accounts, not computers
+#define AUDIT_FILTER "(&(objectCategory=person)(objectClass=user))"
+
+/// Entries per page
+#define AUDIT_PAGE_SIZE 500
+
+/// Default time limit for a whole audit, overridable with CPWD_AUDIT_DEADLINE_S
+#define AUDIT_DEFAULT_DEADLINE_S 1800
+
+/// Account names remembered for the duplicate check; a power of two. Once it's three
+///  quarters full, later names are no longer checked.
+#define AUDIT_SEEN_SLOTS (1 << 20)
+
+enum audit_problem
+{
+    /// No mail attribute, so email-user always says "Email not found"
+    AUDIT_NO_MAIL,
+    /// A mail that can't be a mailbox, or that starts with '-', which sendmail would parse as
+    ///  an option since the address is its first argument
+    AUDIT_BAD_MAIL,
+    /// Several mail values; only the first is ever compared
+    AUDIT_MULTIPLE_MAIL,
+    /// Too long for the request path to hold
+    AUDIT_LONG_MAIL,
+    AUDIT_NO_SAM,
+    /// A sAMAccountName the reset link or the token file can't carry as it is
+    AUDIT_BAD_SAM,
+    AUDIT_LONG_SAM,
+    /// The same sAMAccountName in several domains; a lookup without a server picks either
+    AUDIT_DUPLICATE_SAM,
+    AUDIT_LONG_DN,
+    AUDIT_PROBLEM_COUNT,
+};
+
+/// @brief Audit the user entries of several domains at once, streaming the report
+/// @param targets The domains to audit
+/// @param n Number of domains, at most DIRECTORY_MAX_TARGETS
+/// @param out Where to write the report
+/// @return 0 if every domain was read completely, 1 otherwise
+int audit_domains(struct dir_target *targets, int n, FILE *out);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef CRAPPASSWD_CACHE_H
+#define CRAPPASSWD_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shm.h"
+
+// A small key/value cache shared by all CGI processes, so each request doesn't have to
+//  re-read the service account password, re-run the SamAccountName search, or rediscover
+//  that a DC is down. Fixed-size open-addressed hash table; every slot is a seqlock, so
+//  readers never block and a writer that finds a slot busy just skips caching. Slots keep
+//  the whole key, not just its hash: a cached user dn is written to without looking it up
+//  again, so a collision must never hand back another key's value.
+
+#define CACHE_SHM_NAME "/crappasswd.cache"
+#define CACHE_MAGIC 0x63706303u
+
+/// Number of slots; must be a power of two
+#define CACHE_SLOTS 2048
+
+/// Slots looked at for a key before giving up
+#define CACHE_PROBE 8
+
+/// Largest value that can be cached
+#define CACHE_VALUE_LEN 1400
+
+/// Longest key that can be cached, NUL included; longer ones are just never cached
+#define CACHE_KEY_LEN 512
+
+/// A slot locked for longer than this belongs to a writer that was killed mid-write, and
+///  may be taken over
+#define CACHE_STALE_LOCK_S 2
+
+/// Default time to live for lookups, overridable with CPWD_CACHE_TTL (seconds)
+#define CACHE_DEFAULT_TTL 300
+
+enum cache_kind
+{
+    CACHE_SECRET,
+    CACHE_USER,
+    CACHE_HEALTH,
+    /// A domain that was searched and doesn't have the user
+    CACHE_MISS,
+    CACHE_KIND_COUNT,
+};
+
+struct cache_slot
+{
+    /// Low 32 bits: the sequence, odd while a writer owns the slot. High 32 bits: the
+    ///  CLOCK_MONOTONIC second the writer took it, taken in the same atomic step.
+    uint64_t seq;
+    uint32_t kind;
+    /// Hash of kind and name, to find the slot
+    uint64_t key;
+    char name[CACHE_KEY_LEN];
+    /// CLOCK_MONOTONIC seconds after which the value is stale
+    uint64_t expires;
+    uint32_t len;
+    char value[CACHE_VALUE_LEN];
+};
+
+struct cache_segment
+{
+    struct shm_header header;
+    uint64_t hits[CACHE_KIND_COUNT];
+    uint64_t misses[CACHE_KIND_COUNT];
+    struct cache_slot slots[CACHE_SLOTS];
+};
+
+/// @brief Look up a value
+/// @param kind What sort of value it is; part of the key
+/// @param key The key
+/// @param value Output buffer
+/// @param size Size of the output buffer
+/// @return Length of the value, or -1 if it isn't cached (or the cache is unavailable)
+int cache_get(enum cache_kind kind, const char *key, void *value, size_t size);
+
+/// @brief Like cache_get(), also saying how long the value has left
+/// @param expires_in Set to the seconds until the value goes stale, if it's cached
+int cache_get_ttl(enum cache_kind kind, const char *key, void *value, size_t size, uint32_t *expires_in);
+
+/// @brief Store a value, replacing any existing one. Best effort: may silently not store it.
+/// @param ttl Seconds until it goes stale
+void cache_put(enum cache_kind kind, const char *key, const void *value, size_t len, uint32_t ttl);
+
+/// @brief Forget a value, e.g. once it's known to be wrong
+void cache_drop(enum cache_kind kind, const char *key);
+
+/// @brief The TTL for cached lookups, from CPWD_CACHE_TTL or CACHE_DEFAULT_TTL
+uint32_t cache_ttl(void);
+
+#endif
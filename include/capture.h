@@ -0,0 +1,66 @@
+#ifndef CRAPPASSWD_CAPTURE_H
+#define CRAPPASSWD_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Traffic capture for load testing. With CPWD_CAPTURE set to a file, every request appends
+//  one record holding its CGI environment, POST body, start time, duration and outcome, so
+//  crappasswd_replay can play real bursts back later. Each record goes out in a single
+//  O_APPEND write, so concurrent requests don't interleave. Reset tokens are replaced by
+//  'x's of the same length before anything is written.
+
+/// Marks the start of every record
+#define CAPTURE_MAGIC 0x31435043u
+
+/// Longest QUERY_STRING, REMOTE_ADDR or body kept; longer ones are cut short
+#define CAPTURE_FIELD_MAX 4096
+
+enum capture_mode
+{
+    CAPTURE_EMAIL_USER,
+    CAPTURE_SET_PASSWORD,
+    CAPTURE_OTHER,
+};
+
+/// Fixed part of a record; followed by the remote address, query string and body
+struct capture_record
+{
+    uint32_t magic;
+    uint8_t mode;
+    uint8_t reserved;
+    uint16_t addr_len;
+    uint16_t query_len;
+    uint16_t body_len;
+    /// CONTENT_LENGTH as the server sent it, -1 if unset
+    int32_t content_length;
+    /// What the request ended with: the print_and_quit() status, or 0 for success
+    int32_t result;
+    /// CLOCK_REALTIME when the request started
+    uint64_t start_ns;
+    uint32_t duration_us;
+    uint32_t reserved2;
+};
+
+/// @brief Start capturing this request if CPWD_CAPTURE is set. Copies the environment now,
+///  before anything parses it in place, and writes the record at exit.
+void capture_begin(enum capture_mode mode);
+
+/// @brief Keep a copy of the POST body
+void capture_body(const char *body, size_t len);
+
+/// @brief Record how the request ended
+void capture_result(int result);
+
+/// @brief Overwrite the value of every secret form parameter with 'x's, in place
+/// @param data NUL-terminated form data
+void capture_redact(char *data);
+
+/// @brief Read the next record from a capture log
+/// @param rec The fixed part
+/// @param addr, query, body Buffers of CAPTURE_FIELD_MAX + 1 bytes, NUL-terminated on return
+/// @return 1 if a record was read, 0 at the end of the log, -1 if it's corrupt
+int capture_read(FILE *log, struct capture_record *rec, char *addr, char *query, char *body);
+
+#endif
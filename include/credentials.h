@@ -0,0 +1,37 @@
+#ifndef CRAPPASSWD_CREDENTIALS_H
+#define CRAPPASSWD_CREDENTIALS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Length of a password reset token, not counting the null terminator
+#define TOKEN_LEN 16
+
+/// Length of a generated password: 16 random characters followed by "Aa1!"
+#define PASSWORD_LEN 20
+
+/// Bytes needed for the unicodePwd value of a password of length n: quotes, UTF-16LE, no BOM
+#define UNICODE_PWD_SIZE(n) (((n) + 2) * 2)
+
+/// @brief Generate a random alphanumeric password reset token
+/// @param token Output buffer of TOKEN_LEN + 1 bytes
+void generate_token(char *token);
+
+/// @brief Generate a new password. The random part is followed by Aa1! to cheese the password policy.
+/// @param password Output buffer of PASSWORD_LEN + 1 bytes
+void generate_password(char *password);
+
+/// @brief Encode a password the way AD wants it in unicodePwd:
+///  enclosed in quotes and converted to UTF-16LE (no BOM, no null terminator)
+/// @param dst Output buffer of UNICODE_PWD_SIZE(strlen(password)) bytes
+/// @param password The plain password
+/// @return Number of bytes written to dst
+size_t unicode_pwd_encode(uint8_t *dst, const char *password);
+
+/// @brief Check a token from a reset link against the contents of the user's reset file
+/// @param token The token supplied by the user
+/// @param contents The contents of the ".<username>" file, NUL-terminated
+/// @return 1 if the token is valid, 0 otherwise
+int token_verify(const char *token, const char *contents);
+
+#endif
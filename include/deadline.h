@@ -0,0 +1,32 @@
+#ifndef CRAPPASSWD_DEADLINE_H
+#define CRAPPASSWD_DEADLINE_H
+
+#include <sys/time.h>
+#include <time.h>
+
+// An end-to-end time budget for one request. Every phase (queueing, connect, bind, search,
+//  modify, mail) takes its timeout from what's left rather than having its own.
+
+/// Default budget for a whole request, overridable with CPWD_DEADLINE_MS
+#define DEADLINE_DEFAULT_MS 5000
+
+struct deadline
+{
+    /// CLOCK_MONOTONIC time the request must be finished by
+    struct timespec end;
+};
+
+/// @brief Start a deadline budget_ms from now
+void deadline_start(struct deadline *deadline, long budget_ms);
+
+/// @brief Start the request deadline from CPWD_DEADLINE_MS, or DEADLINE_DEFAULT_MS
+void deadline_start_request(struct deadline *deadline);
+
+/// @brief Milliseconds left before the deadline; 0 once it has passed
+long deadline_remaining_ms(const struct deadline *deadline);
+
+/// @brief The time left as a timeval, for the libldap calls that take one
+/// @return 0, or -1 if the deadline has already passed
+int deadline_timeval(const struct deadline *deadline, struct timeval *tv);
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef CRAPPASSWD_DIRECTORY_H
+#define CRAPPASSWD_DIRECTORY_H
+
+#include <stddef.h>
+
+#include <ldap.h>
+
+#include "deadline.h"
+
+// A bound connection to a target directory. Every operation is sent asynchronously and
+//  waited for only until the request's deadline; anything still outstanding then is
+//  abandoned with ldap_abandon_ext() and reported as LDAP_TIMEOUT.
+//
+// The server uri may list replicas after the primary, separated by spaces, the way
+//  ldap_initialize() takes them. If a search on the primary runs past the target's usual
+//  latency (CPWD_HEDGE_PERCENTILE, default p95), the same search is also sent to the
+//  replicas and whichever answers first wins.
+//
+// Servers are tried in order until one binds. One that can't be reached is remembered as
+//  down for DIRECTORY_DOWN_TTL seconds in the shared cache and tried after the others; if
+//  they're all down, dir_open() only tries the one that failed longest ago. A timeout
+//  doesn't mark a server down, since it may only mean the request was short of time.
+//
+// When it isn't known which domain holds an entry, dir_find_first() asks several at once:
+//  every domain's healthiest server is connected to, bound and searched concurrently from
+//  one poll loop, the first domain to return an entry the caller accepts wins, and the
+//  others are abandoned. dir_scan_all() pages through every matching entry of several
+//  domains the same way.
+
+#define DIRECTORY_URI_LEN 512
+
+/// Hedge after this long while there isn't enough latency history for a percentile
+#define DIRECTORY_DEFAULT_HEDGE_MS 500
+
+#define DIRECTORY_DEFAULT_HEDGE_PERCENTILE 95
+
+/// Longest entry dn we handle
+#define DIRECTORY_DN_LEN 1024
+
+/// LDAP_SERVER_DOMAIN_SCOPE_OID: don't generate referrals to other domains
+#define DIRECTORY_DOMAIN_SCOPE_OID "1.2.840.113556.1.4.1339"
+
+/// Seconds an unreachable server is skipped for
+#define DIRECTORY_DOWN_TTL 30
+
+/// Most domains dir_find_first() will ask at once
+#define DIRECTORY_MAX_TARGETS 16
+
+struct directory
+{
+    LDAP *ld;
+    /// Second connection for hedged searches, opened on first use
+    LDAP *replica;
+    /// The uri list, healthiest first, and the part after the server we bound to
+    char uri[DIRECTORY_URI_LEN];
+    const char *replica_uri;
+    /// "<uri>+<base>", the key for latency history
+    char target[DIRECTORY_URI_LEN * 2];
+    const char *bind_dn;
+    const char *bind_pw;
+    const struct deadline *deadline;
+};
+
+/// @brief Connect and bind
+/// @param dir The directory to fill in
+/// @param uri Server uri, optionally followed by replica uris
+/// @param base The base dn, for the latency history key
+/// @param bind_dn The dn to bind as
+/// @param bind_pw Its password
+/// @param deadline Bounds the connect and every later operation on dir
+/// @return LDAP result code
+int dir_open(struct directory *dir, const char *uri, const char *base, const char *bind_dn, const char *bind_pw,
+             const struct deadline *deadline);
+
+/// @brief Find one entry under base and copy out the first value of an attribute. Tries the
+///  narrower searches the planner (plan.h) suggests for this target before the whole subtree.
+/// @param dir An open directory
+/// @param base Where to search
+/// @param filter The search filter
+/// @param attr The attribute to return
+/// @param value Output buffer for the value, NUL-terminated
+/// @param value_size Size of the output buffer
+/// @param dn Output buffer for the entry's dn, or NULL. Filled in even if the entry has no attr.
+/// @param dn_size Size of the dn buffer
+/// @return LDAP result code; LDAP_NO_SUCH_OBJECT if nothing matched, LDAP_NO_SUCH_ATTRIBUTE
+///  if the entry has no such attribute
+int dir_find(struct directory *dir, const char *base, const char *filter, const char *attr, char *value,
+             size_t value_size, char *dn, size_t dn_size);
+
+/// One domain for dir_find_first() to look in
+struct dir_target
+{
+    /// Server uri, optionally followed by replica uris; only the healthiest one is asked
+    const char *uri;
+    const char *base;
+    const char *bind_dn;
+    const char *bind_pw;
+    /// Set to how it went in this domain: LDAP_SUCCESS or LDAP_NO_SUCH_ATTRIBUTE for the
+    ///  winner, LDAP_NO_SUCH_OBJECT if the domain has no such entry, LDAP_CANCELLED if
+    ///  another domain answered first, or the error that stopped it
+    int status;
+};
+
+/// @brief Search several domains at once for one entry and copy out the first value of an
+///  attribute from whichever finds an acceptable one first
+/// @param targets The domains to ask; each one's status is filled in, LDAP_COMPARE_FALSE for
+///  one whose entry wasn't accepted
+/// @param n Number of targets, at most DIRECTORY_MAX_TARGETS
+/// @param filter The search filter, run as a subtree search of each base
+/// @param attr The attribute to return
+/// @param value Output buffer for the value, NUL-terminated
+/// @param value_size Size of the output buffer
+/// @param dn Output buffer for the entry's dn
+/// @param dn_size Size of the dn buffer
+/// @param accept Whether an entry's value will do, or NULL to take the first entry found.
+///  Names needn't be unique across domains, so a rejected entry doesn't end the lookup; an
+///  entry without attr is never accepted.
+/// @param context Passed to accept
+/// @param deadline Bounds the whole lookup
+/// @return Index of the target the entry was found in, or -1 if none had it (or answered)
+int dir_find_first(struct dir_target *targets, int n, const char *filter, const char *attr, char *value,
+                   size_t value_size, char *dn, size_t dn_size, int (*accept)(void *context, const char *value),
+                   void *context, const struct deadline *deadline);
+
+/// What dir_scan_all() looks for, and where it hands each entry
+struct dir_scan
+{
+    const char *filter;
+    /// NULL-terminated list of attributes to fetch
+    char **attrs;
+    /// Entries per page; at most this many are ever waiting per domain
+    int page_size;
+    /// Called with each entry as it arrives; the entry is freed once this returns
+    void (*entry)(void *context, int target, LDAP *ld, LDAPMessage *entry);
+    void *context;
+};
+
+/// @brief Page through every entry matching a filter in several domains at once
+/// @param targets The domains to scan; each one's status is set to LDAP_SUCCESS once all of
+///  it has been read, or to the error that stopped it
+/// @param n Number of targets, at most DIRECTORY_MAX_TARGETS
+/// @param scan The search, and the callback for its entries
+/// @param deadline Bounds the whole scan
+/// @return How many domains were read completely
+int dir_scan_all(struct dir_target *targets, int n, const struct dir_scan *scan, const struct deadline *deadline);
+
+/// @brief Modify an entry
+/// @return LDAP result code
+int dir_modify(struct directory *dir, const char *dn, LDAPMod **mods);
+
+/// @brief Unbind and free both connections
+/// @return LDAP result code of unbinding the primary
+int dir_close(struct directory *dir);
+
+#endif
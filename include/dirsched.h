@@ -0,0 +1,123 @@
+#ifndef CRAPPASSWD_DIRSCHED_H
+#define CRAPPASSWD_DIRSCHED_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "shm.h"
+
+// Admission control across target directories. One deployment serves many domains, and a
+//  dead DC makes every request for it sit until the LDAP timeout fires. Each CGI process
+//  asks for a slot before talking to its directory. Slots are shared by all domains, each
+//  domain has a concurrency cap, and waiting requests are granted slots by deficit round
+//  robin, where a request costs as much as its domain's recent service time. A domain whose
+//  DC has gone slow fills its own cap and then waits its turn instead of taking every slot.
+//
+// A process holds at most one slot. A lookup across every configured domain (see
+//  dir_find_first()) queues as a single "*" target of its own, so it takes one slot while
+//  it searches each domain's DC: the per-domain caps don't apply to those searches.
+
+#define SCHED_SHM_NAME "/crappasswd.sched"
+#define SCHED_MAGIC 0x63707303u
+
+/// Number of distinct target directories tracked
+#define SCHED_DOMAINS 64
+
+/// Waiting plus running requests per domain
+#define SCHED_WAITERS 32
+
+/// Bytes of "<uri>+<base>" kept for display
+#define SCHED_NAME_LEN 96
+
+/// Credit each domain gets per round, in milliseconds of expected service time
+#define SCHED_QUANTUM_MS 100
+
+/// Search latency histogram buckets; bucket i counts searches that took under 2^i ms
+#define SCHED_HIST_BUCKETS 16
+
+/// Histogram counts are halved once they add up to this, so old latencies fade out
+#define SCHED_HIST_MAX 2048
+
+/// Fewer samples than this and sched_latency_ms() won't guess
+#define SCHED_HIST_MIN_SAMPLES 20
+
+/// Defaults for settings read from the environment when the segment is created
+#define SCHED_DEFAULT_SLOTS 16
+#define SCHED_DEFAULT_DOMAIN_CAP 4
+#define SCHED_DEFAULT_WAIT_MS 2000
+
+enum sched_waiter_state
+{
+    SCHED_FREE,
+    SCHED_WAITING,
+    SCHED_RUNNING,
+};
+
+struct sched_waiter
+{
+    pid_t pid;
+    uint32_t state;
+    uint64_t enqueued_ns;
+};
+
+struct sched_domain
+{
+    /// Hash of the name, 0 if the slot is unused
+    uint64_t key;
+    char name[SCHED_NAME_LEN];
+    uint32_t in_flight;
+    uint32_t queued;
+    int32_t deficit_ms;
+    /// Moving average of how long a request holds its slot
+    uint32_t service_ms;
+    uint64_t served;
+    uint64_t rejected;
+    uint64_t wait_total_ns;
+    uint64_t wait_max_ns;
+    uint64_t last_used_ns;
+    uint32_t search_hist[SCHED_HIST_BUCKETS];
+    struct sched_waiter waiters[SCHED_WAITERS];
+};
+
+struct sched_segment
+{
+    struct shm_header header;
+    pthread_mutex_t lock;
+    /// Bumped whenever slots are granted; waiters sleep on it with shm_wait()
+    uint32_t grants;
+    /// Slots shared by all domains
+    uint32_t slots;
+    uint32_t in_use;
+    /// Per-domain concurrency cap
+    uint32_t domain_cap;
+    /// Longest a request will queue for a slot
+    uint32_t wait_ms;
+    /// Deficit round robin cursor, and whether the current domain got its quantum yet
+    uint32_t rr;
+    uint32_t rr_charged;
+    struct sched_domain domains[SCHED_DOMAINS];
+};
+
+/// @brief Wait for a slot to talk to a directory. The slot is released by sched_release(),
+///  or when the process exits.
+/// @param name The target, "<uri>+<base>"
+/// @param max_wait_ms Upper bound on the wait, from the request's remaining budget; the wait
+///  is the smaller of this and the configured limit
+/// @return 0 once the slot is held (or if scheduling is unavailable), -1 if the domain stayed
+///  too busy for the whole wait
+int sched_acquire(const char *name, long max_wait_ms);
+
+/// @brief Release the slot held by this process, if any
+void sched_release(void);
+
+/// @brief Record how long a full subtree search against a target took, for the hedge delay
+void sched_record_latency(const char *name, uint32_t ms);
+
+/// @brief Estimate a search latency percentile for a target from recent searches
+/// @param name The target, "<uri>+<base>"
+/// @param percentile 1-99
+/// @return The latency in ms (rounded up to a power of two), or 0 if there isn't enough history
+uint32_t sched_latency_ms(const char *name, int percentile);
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef CRAPPASSWD_FLIGHT_H
+#define CRAPPASSWD_FLIGHT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "credentials.h"
+#include "shm.h"
+
+// Single-flight coalescing of reset requests. Users press the reset button repeatedly, and
+//  each press would bind, search, write a new token and fork another sendmail. The first
+//  request for a (server, username) leads; duplicates that arrive while it runs wait for it
+//  and share its outcome, and repeats within the window after it finished reuse the token
+//  it already mailed. A duplicate only coalesces if it asks for the same email address, so
+//  it can never ride on a lookup that verified someone else's address.
+
+#define FLIGHT_SHM_NAME "/crappasswd.flight"
+#define FLIGHT_MAGIC 0x63706602u
+
+/// Number of users tracked at once
+#define FLIGHT_SLOTS 256
+
+/// Entries looked at for a key before running uncoalesced
+#define FLIGHT_PROBE 16
+
+#define FLIGHT_EMAIL_LEN 256
+
+/// Default for CPWD_FLIGHT_WINDOW_S, read when the segment is created
+#define FLIGHT_DEFAULT_WINDOW_S 60
+
+enum flight_state
+{
+    FLIGHT_FREE,
+    FLIGHT_RUNNING,
+    FLIGHT_DONE,
+};
+
+enum flight_role
+{
+    /// Do the work, then call flight_end()
+    FLIGHT_LEAD,
+    /// A concurrent duplicate finished it for us
+    FLIGHT_JOINED,
+    /// It was done recently; the outstanding token still stands
+    FLIGHT_REUSED,
+    /// A duplicate is still running and didn't finish within our budget
+    FLIGHT_BUSY,
+};
+
+struct flight_entry
+{
+    /// Hash of "<uri>+<base>:<username>", 0 if unused
+    uint64_t key;
+    uint32_t state;
+    pid_t owner;
+    /// Whether the leader had to search the directory (rather than hit the cache)
+    uint32_t searched;
+    /// CLOCK_MONOTONIC seconds when it finished
+    uint64_t done_s;
+    char email[FLIGHT_EMAIL_LEN];
+    char token[TOKEN_LEN + 1];
+};
+
+struct flight_segment
+{
+    struct shm_header header;
+    pthread_mutex_t lock;
+    /// Bumped whenever an entry finishes or is given up; waiters sleep on it with shm_wait()
+    uint32_t changes;
+    /// How long a finished reset's token is reused for
+    uint32_t window_s;
+    uint64_t led;
+    uint64_t joined;
+    uint64_t reused;
+    uint64_t searches_saved;
+    uint64_t mails_saved;
+    struct flight_entry entries[FLIGHT_SLOTS];
+};
+
+/// @brief Join or start the reset for a user
+/// @param key "<uri>+<base>:<username>"
+/// @param email The address this request asked to mail
+/// @param max_wait_ms Longest to wait for a running duplicate (the request's remaining budget)
+/// @param token Set to the outstanding token when joining or reusing
+/// @return What this request should do. FLIGHT_LEAD is also returned when coalescing is
+///  unavailable, or the key can't be tracked.
+enum flight_role flight_begin(const char *key, const char *email, long max_wait_ms, char *token);
+
+/// @brief Finish the reset this process leads, waking any duplicates. If the process exits
+///  without calling this, the duplicates take over instead.
+/// @param token The token that was mailed
+/// @param searched Whether the directory had to be searched
+void flight_end(const char *token, int searched);
+
+/// @brief Stop reusing a user's token, e.g. once it has been redeemed
+void flight_forget(const char *key);
+
+#endif
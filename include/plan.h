@@ -0,0 +1,109 @@
+#ifndef CRAPPASSWD_PLAN_H
+#define CRAPPASSWD_PLAN_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "shm.h"
+
+// Search planning for user lookups. A subtree search from the domain root makes an AD
+//  forest with deep OU trees walk far more than it needs to, but users almost always live
+//  in a handful of containers. For each target we learn the containers the users we found
+//  were in, and try a one-level search of the busiest one first, then a subtree search of
+//  the deepest container they all share, and only then the whole tree. A step whose hit
+//  rate falls below PLAN_MIN_HIT_PCT is skipped, apart from an occasional probe to notice
+//  when it starts paying off again.
+
+#define PLAN_SHM_NAME "/crappasswd.plan"
+#define PLAN_MAGIC 0x63707001u
+
+/// Number of distinct target directories tracked
+#define PLAN_TARGETS 64
+
+/// Containers remembered per target
+#define PLAN_CONTAINERS 8
+
+#define PLAN_DN_LEN 256
+
+/// Bytes of "<uri>+<base>" kept for display
+#define PLAN_NAME_LEN 96
+
+/// A step needs this many tries before its hit rate counts
+#define PLAN_MIN_SAMPLES 10
+
+/// Steps that hit less often than this are skipped
+#define PLAN_MIN_HIT_PCT 30
+
+/// A skipped step is still tried once in this many lookups
+#define PLAN_PROBE_EVERY 16
+
+/// Counts are halved once tries reach this, so old behaviour fades out
+#define PLAN_DECAY_AT 1024
+
+enum plan_strategy
+{
+    /// One-level search of the container most users were found in
+    PLAN_ONE_LEVEL,
+    /// Subtree search of the deepest container all known users share
+    PLAN_NARROW_SUBTREE,
+    /// Subtree search of the whole base
+    PLAN_FULL_SUBTREE,
+    PLAN_STRATEGY_COUNT,
+};
+
+struct plan_stats
+{
+    uint64_t tries;
+    uint64_t hits;
+    uint64_t total_ms;
+    /// Lookups that skipped this step for its low hit rate
+    uint64_t skipped;
+};
+
+struct plan_container
+{
+    char dn[PLAN_DN_LEN];
+    uint32_t hits;
+};
+
+struct plan_target
+{
+    /// Hash of the name, 0 if the slot is unused
+    uint64_t key;
+    char name[PLAN_NAME_LEN];
+    uint64_t last_used_s;
+    struct plan_container containers[PLAN_CONTAINERS];
+    struct plan_stats stats[PLAN_STRATEGY_COUNT];
+};
+
+struct plan_segment
+{
+    struct shm_header header;
+    pthread_mutex_t lock;
+    struct plan_target targets[PLAN_TARGETS];
+};
+
+/// One search to try; PLAN_ONE_LEVEL searches one level below base, the others the subtree
+struct plan_step
+{
+    enum plan_strategy strategy;
+    char base[PLAN_DN_LEN];
+};
+
+/// @brief Decide which searches to try, in order, to find a user under base
+/// @param target The target, "<uri>+<base>"
+/// @param base The base dn the caller would search
+/// @param steps Output; always ends with a full subtree search of base
+/// @return Number of steps, 1 to PLAN_STRATEGY_COUNT
+int plan_search(const char *target, const char *base, struct plan_step *steps);
+
+/// @brief Record how a step went
+/// @param found_dn The dn of the entry it found, or NULL on a miss
+/// @param ms How long the search took
+void plan_record(const char *target, const char *base, enum plan_strategy strategy, const char *found_dn,
+                 uint32_t ms);
+
+/// @brief Name of a strategy, for display
+const char *plan_strategy_name(enum plan_strategy strategy);
+
+#endif
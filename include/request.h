@@ -0,0 +1,45 @@
+#ifndef CRAPPASSWD_REQUEST_H
+#define CRAPPASSWD_REQUEST_H
+
+#include <stddef.h>
+
+// Helpers for picking apart the CGI request: form/query parsing, percent decoding,
+//  and building the LDAP filters we search with.
+
+/// Size of the buffer a user's email from the directory is read into
+#define REQUEST_EMAIL_LEN 256
+
+/// Size of the buffer the user search filter is built in
+#define REQUEST_FILTER_LEN 255
+
+/// @brief Find a parameter in a form body or query string ("a=1&b=2")
+/// @param data The form data to search, NUL-terminated
+/// @param name The parameter name, without the '='
+/// @param value_len Set to the length of the (still encoded) value, up to the next '&'
+/// @return Pointer to the start of the value inside data, or NULL if not present
+char *form_param(char *data, const char *name, size_t *value_len);
+
+/// @brief Decode %XX escapes. '+' is left alone, like curl_easy_unescape(), because
+///  we use it as the separator between the server uri and base dn.
+/// @param dst Output buffer, at least len + 1 bytes. May be the same as src.
+/// @param src The encoded input
+/// @param len Number of bytes of src to decode
+/// @return The decoded length; dst is NUL-terminated
+size_t percent_decode(char *dst, const char *src, size_t len);
+
+/// @brief Encode a value for a query string: everything but letters, digits and "-._~" is
+///  written as %XX, so '+' survives as data rather than being taken as the separator
+/// @param dst Output buffer
+/// @param dst_size Size of the output buffer
+/// @param src The raw value
+/// @return 0 on success, -1 if the encoded value does not fit
+int percent_encode(char *dst, size_t dst_size, const char *src);
+
+/// @brief Build "(SamAccountName=<username>)" with the username escaped per RFC 4515
+/// @param dst Output buffer
+/// @param dst_size Size of the output buffer
+/// @param username The raw username
+/// @return 0 on success, -1 if the filter does not fit
+int user_filter(char *dst, size_t dst_size, const char *username);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef CRAPPASSWD_SHM_H
+#define CRAPPASSWD_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every CGI request is a fresh process, so anything we want to remember between requests
+//  lives in a small POSIX shared memory segment. Each segment starts with this header.
+//
+// With CPWD_SHM_PREFIX set (to a name without '/'), every segment is opened under
+//  "/<prefix>.<name>" instead, so a replay or a test keeps apart from the live server's
+//  segments.
+
+struct shm_header
+{
+    /// Set last by whoever created the segment; identifies the layout
+    uint32_t magic;
+    /// Size of the whole segment, including this header
+    uint32_t size;
+};
+
+/// @brief Map a named shared memory segment, creating and initializing it if it doesn't exist
+/// @param name The POSIX shm name, e.g. "/crappasswd.trace"
+/// @param size Size of the segment, starting with a struct shm_header
+/// @param magic Layout identifier. Bump it whenever the layout changes.
+/// @param init Called once by the creating process, before anyone else can see the segment
+/// @return The mapped segment, or NULL if it couldn't be mapped. A segment with a different
+///  layout (e.g. from before an upgrade) is unlinked and created afresh. Callers should carry
+///  on without the feature rather than fail the request.
+void *shm_attach(const char *name, size_t size, uint32_t magic, void (*init)(void *segment));
+
+/// @brief Sleep until shm_wake() is called on a word in shared memory, or a timeout. Used in
+///  place of a process-shared condition variable, whose state a waiter killed mid-wait (as
+///  web servers do to CGI processes) can leave corrupted for everyone after it.
+/// @param word The word, in a shared segment
+/// @param seen Its value when the caller last looked; returns at once if it has changed since
+/// @param timeout_ms Longest to sleep
+void shm_wait(uint32_t *word, uint32_t seen, long timeout_ms);
+
+/// @brief Change a word and wake everything sleeping in shm_wait() on it
+void shm_wake(uint32_t *word);
+
+/// @brief Hash a string into a key for the tables kept in shared memory (FNV-1a)
+/// @return The key, never 0, so 0 can mark an empty slot
+uint64_t shm_key(const char *s);
+
+/// @brief Map an existing segment read-only, for the inspection tools
+/// @return The mapped segment, or NULL if it doesn't exist or has a different layout
+const void *shm_attach_readonly(const char *name, size_t size, uint32_t magic);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef CRAPPASSWD_TRACE_H
+#define CRAPPASSWD_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shm.h"
+
+// Structured request tracing. Events go into a fixed-size ring buffer in shared memory
+//  instead of being printed into the HTTP response; `crappasswd_stat trace` decodes them.
+// Writers never block or take locks: a slot is claimed with one atomic increment and
+//  guarded by a sequence number so readers can tell when they raced a writer.
+
+#define TRACE_SHM_NAME "/crappasswd.trace"
+#define TRACE_MAGIC 0x63707401u
+
+/// Number of events kept; older ones are overwritten
+#define TRACE_SLOTS 4096
+
+/// Bytes of the target server kept in each event
+#define TRACE_SERVER_LEN 64
+
+enum trace_phase
+{
+    TRACE_START,
+    TRACE_PARSED,
+    TRACE_BIND,
+    TRACE_SEARCH,
+    TRACE_VERIFY,
+    TRACE_UNBIND,
+    TRACE_MAIL,
+    TRACE_TOKEN,
+    TRACE_MODIFY,
+    TRACE_DONE,
+    TRACE_FAIL,
+    TRACE_QUEUE,
+    TRACE_HEDGE,
+    TRACE_CACHE,
+    TRACE_COALESCE,
+    TRACE_FANOUT,
+    TRACE_PHASE_COUNT,
+};
+
+struct trace_event
+{
+    /// 2 * (ring position + 1) once written; odd while a writer is filling it in
+    uint64_t seq;
+    uint64_t request_id;
+    /// CLOCK_REALTIME, in nanoseconds
+    uint64_t timestamp_ns;
+    uint32_t pid;
+    uint32_t phase;
+    /// LDAP result code, an exit status for TRACE_FAIL and TRACE_MAIL, or the enum flight_role
+    ///  for TRACE_COALESCE
+    int32_t result;
+    uint32_t reserved;
+    char server[TRACE_SERVER_LEN];
+};
+
+struct trace_ring
+{
+    struct shm_header header;
+    /// Next request id to hand out
+    uint64_t next_request_id;
+    /// Total number of events ever written; the next one goes in slot head % TRACE_SLOTS
+    uint64_t head;
+    struct trace_event events[TRACE_SLOTS];
+};
+
+/// @brief Attach to the trace ring and allocate a request id for this process.
+///  Tracing is quietly disabled if the ring can't be mapped or CPWD_TRACE=0.
+void trace_open(void);
+
+/// @brief Set the target server recorded with subsequent events
+void trace_server(const char *server);
+
+/// @brief Record an event for the current request
+/// @param phase What just happened
+/// @param result The LDAP result code (or exit status) it finished with
+void trace(enum trace_phase phase, int result);
+
+/// @brief Short name for a phase, for the dump tool
+const char *trace_phase_name(uint32_t phase);
+
+/// @brief Copy the most recent events out of a ring, oldest first, skipping any being written
+/// @param ring The mapped ring
+/// @param out Output array
+/// @param max Size of the output array
+/// @return Number of events copied
+size_t trace_snapshot(const struct trace_ring *ring, struct trace_event *out, size_t max);
+
+#endif
@@ -0,0 +1,274 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audit.h"
+#include "request.h"
+#include "shm.h"
+
+static const char *problem_names[AUDIT_PROBLEM_COUNT] = {
+    [AUDIT_NO_MAIL] = "no-mail",
+    [AUDIT_BAD_MAIL] = "bad-mail",
+    [AUDIT_MULTIPLE_MAIL] = "multiple-mail",
+    [AUDIT_LONG_MAIL] = "long-mail",
+    [AUDIT_NO_SAM] = "no-sam",
+    [AUDIT_BAD_SAM] = "bad-sam",
+    [AUDIT_LONG_SAM] = "long-sam",
+    [AUDIT_DUPLICATE_SAM] = "duplicate-sam",
+    [AUDIT_LONG_DN] = "long-dn",
+};
+
+/// Where an audit has got to
+struct audit
+{
+    struct dir_target *targets;
+    int n;
+    FILE *out;
+    uint64_t entries[DIRECTORY_MAX_TARGETS];
+    uint64_t problems[DIRECTORY_MAX_TARGETS];
+    uint64_t by_problem[AUDIT_PROBLEM_COUNT];
+    /// Account name hashes with the low 4 bits replaced by the domain index; 0 if unused
+    uint64_t *seen;
+    uint32_t seen_count;
+    /// Names that came after the table filled up, so weren't checked for duplicates
+    uint64_t unchecked;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+/// @brief Time limit for the whole audit, from CPWD_AUDIT_DEADLINE_S or AUDIT_DEFAULT_DEADLINE_S
+static long audit_budget_ms(void)
+{
+    const char *setting = getenv("CPWD_AUDIT_DEADLINE_S");
+    long seconds = setting == NULL ? 0 : atol(setting);
+    return (seconds > 0 ? seconds : AUDIT_DEFAULT_DEADLINE_S) * 1000L;
+}
+
+/// @brief Write a field of the report with control characters as \xNN, so a tab or newline
+///  in the directory's data can't split or forge a line
+static void write_field(FILE *out, const char *field)
+{
+    for (const unsigned char *p = (const unsigned char *)field; *p != 0; p++)
+    {
+        if (*p < 0x20 || *p == 0x7f)
+        {
+            fprintf(out, "\\x%02X", *p);
+        }
+        else
+        {
+            fputc(*p, out);
+        }
+    }
+}
+
+/// @brief Write one line of the report
+static void report(struct audit *audit, int target, enum audit_problem problem, const char *dn, const char *detail)
+{
+    audit->problems[target]++;
+    audit->by_problem[problem]++;
+    fprintf(audit->out, "%s\t", problem_names[problem]);
+    write_field(audit->out, audit->targets[target].uri);
+    fputc('+', audit->out);
+    write_field(audit->out, audit->targets[target].base);
+    fputc('\t', audit->out);
+    write_field(audit->out, dn);
+    fputc('\t', audit->out);
+    write_field(audit->out, detail);
+    fputc('\n', audit->out);
+}
+
+/// @brief Whether a username goes through the reset link and the token file name unchanged
+static int link_safe(const char *username)
+{
+    for (const char *p = username; *p != 0; p++)
+    {
+        if (!isalnum((unsigned char)*p) && strchr("-._~$", *p) == NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// @brief Remember an account name, and say which other domain already had it
+/// @return Index of another domain with the same name, or -1
+static int seen_elsewhere(struct audit *audit, int target, const char *username)
+{
+    if (audit->seen == NULL || audit->seen_count >= AUDIT_SEEN_SLOTS / 4 * 3)
+    {
+        audit->unchecked++;
+        return -1;
+    }
+
+    // sAMAccountName is case-insensitive
+    char lower[256];
+    size_t len = strlen(username) < sizeof(lower) - 1 ? strlen(username) : sizeof(lower) - 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        lower[i] = (char)tolower((unsigned char)username[i]);
+    }
+    lower[len] = 0;
+
+    uint64_t name = shm_key(lower) & ~0xfULL;
+    name = name != 0 ? name : 0x10;
+    for (uint64_t i = name >> 4;; i++)
+    {
+        uint64_t *slot = &audit->seen[i & (AUDIT_SEEN_SLOTS - 1)];
+        if (*slot == 0)
+        {
+            *slot = name | (uint64_t)target;
+            audit->seen_count++;
+            return -1;
+        }
+        if ((*slot & ~0xfULL) == name && (int)(*slot & 0xf) != target)
+        {
+            return (int)(*slot & 0xf);
+        }
+        if ((*slot & ~0xfULL) == name)
+        {
+            return -1;
+        }
+    }
+}
+
+/// @brief Check one entry, as dir_scan_all() hands it over
+static void audit_entry(void *context, int target, LDAP *ld, LDAPMessage *entry)
+{
+    struct audit *audit = context;
+    audit->entries[target]++;
+
+    char *dn = ldap_get_dn(ld, entry);
+    const char *shown_dn = dn != NULL ? dn : "?";
+    char detail[REQUEST_EMAIL_LEN + 64];
+
+    if (dn != NULL && strlen(dn) >= DIRECTORY_DN_LEN)
+    {
+        snprintf(detail, sizeof(detail), "%zu bytes", strlen(dn));
+        report(audit, target, AUDIT_LONG_DN, shown_dn, detail);
+    }
+
+    struct berval **mail = ldap_get_values_len(ld, entry, "mail");
+    int mail_count = ldap_count_values_len(mail);
+    if (mail == NULL || mail_count == 0)
+    {
+        report(audit, target, AUDIT_NO_MAIL, shown_dn, "");
+    }
+    else
+    {
+        const struct berval *first = mail[0];
+        if (first->bv_len >= REQUEST_EMAIL_LEN)
+        {
+            snprintf(detail, sizeof(detail), "%lu bytes", (unsigned long)first->bv_len);
+            report(audit, target, AUDIT_LONG_MAIL, shown_dn, detail);
+        }
+        else
+        {
+            // The reset is mailed to this. send_mail() hands it to sendmail as the first
+            //  argument, where a leading '-' would be parsed as an option rather than a recipient
+            snprintf(detail, sizeof(detail), "%.*s", (int)first->bv_len, first->bv_val);
+            const char *at = strchr(detail, '@');
+            if (strlen(detail) != first->bv_len || at == NULL || at == detail || at[1] == 0 || detail[0] == '-' ||
+                strpbrk(detail, " \t\r\n") != NULL)
+            {
+                report(audit, target, AUDIT_BAD_MAIL, shown_dn, detail);
+            }
+        }
+        if (mail_count > 1)
+        {
+            snprintf(detail, sizeof(detail), "%d values", mail_count);
+            report(audit, target, AUDIT_MULTIPLE_MAIL, shown_dn, detail);
+        }
+    }
+    ldap_value_free_len(mail);
+
+    struct berval **sam = ldap_get_values_len(ld, entry, "sAMAccountName");
+    if (sam == NULL || sam[0] == NULL)
+    {
+        report(audit, target, AUDIT_NO_SAM, shown_dn, "");
+    }
+    else
+    {
+        char username[256];
+        char filter[REQUEST_FILTER_LEN];
+        snprintf(username, sizeof(username), "%.*s", (int)sam[0]->bv_len, sam[0]->bv_val);
+
+        if (sam[0]->bv_len >= sizeof(username) || user_filter(filter, sizeof(filter), username) != 0)
+        {
+            snprintf(detail, sizeof(detail), "%lu bytes", (unsigned long)sam[0]->bv_len);
+            report(audit, target, AUDIT_LONG_SAM, shown_dn, detail);
+        }
+        else if (strlen(username) != sam[0]->bv_len || !link_safe(username))
+        {
+            report(audit, target, AUDIT_BAD_SAM, shown_dn, username);
+        }
+
+        int other = seen_elsewhere(audit, target, username);
+        if (other >= 0)
+        {
+            snprintf(detail, sizeof(detail), "%.64s also in %.64s+%.64s", username, audit->targets[other].uri,
+                     audit->targets[other].base);
+            report(audit, target, AUDIT_DUPLICATE_SAM, shown_dn, detail);
+        }
+    }
+    ldap_value_free_len(sam);
+    ldap_memfree(dn);
+}
+
+int audit_domains(struct dir_target *targets, int n, FILE *out)
+{
+    struct audit audit = {
+        .targets = targets,
+        .n = n < DIRECTORY_MAX_TARGETS ? n : DIRECTORY_MAX_TARGETS,
+        .out = out,
+        .seen = calloc(AUDIT_SEEN_SLOTS, sizeof(uint64_t)),
+    };
+
+    struct dir_scan scan = {
+        .filter = AUDIT_FILTER,
+        .attrs = (char *[]){"mail", "sAMAccountName", NULL},
+        .page_size = AUDIT_PAGE_SIZE,
+        .entry = audit_entry,
+        .context = &audit,
+    };
+
+    struct deadline deadline;
+    deadline_start(&deadline, audit_budget_ms());
+    uint64_t start = now_ms();
+
+    fprintf(out, "# problem\tdomain\tdn\tdetail\n");
+    int complete = dir_scan_all(targets, audit.n, &scan, &deadline);
+
+    uint64_t entries = 0;
+    uint64_t problems = 0;
+    for (int i = 0; i < audit.n; i++)
+    {
+        entries += audit.entries[i];
+        problems += audit.problems[i];
+        fprintf(out, "# %s+%s: %llu users, %llu problems, %s\n", targets[i].uri, targets[i].base,
+                (unsigned long long)audit.entries[i], (unsigned long long)audit.problems[i],
+                targets[i].status == LDAP_SUCCESS ? "complete" : ldap_err2string(targets[i].status));
+    }
+
+    fprintf(out, "# %d of %d domains complete, %llu users, %llu problems in %.1fs\n", complete, audit.n,
+            (unsigned long long)entries, (unsigned long long)problems, (double)(now_ms() - start) / 1000.0);
+    for (int p = 0; p < AUDIT_PROBLEM_COUNT; p++)
+    {
+        if (audit.by_problem[p] > 0)
+        {
+            fprintf(out, "#   %-16s %llu\n", problem_names[p], (unsigned long long)audit.by_problem[p]);
+        }
+    }
+    if (audit.unchecked > 0)
+    {
+        fprintf(out, "# %llu names not checked for duplicates\n", (unsigned long long)audit.unchecked);
+    }
+
+    free(audit.seen);
+    return complete == audit.n ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+
+static struct cache_segment *seg;
+
+/// Set once attaching has failed, so we don't retry on every lookup
+static int unavailable;
+
+static uint64_t now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec;
+}
+
+static int attach(void)
+{
+    if (seg == NULL && !unavailable)
+    {
+        seg = shm_attach(CACHE_SHM_NAME, sizeof(struct cache_segment), CACHE_MAGIC, NULL);
+        unavailable = seg == NULL;
+    }
+    return seg == NULL ? -1 : 0;
+}
+
+/// @brief The table key for a (kind, key) pair
+static uint64_t slot_key(enum cache_kind kind, const char *key)
+{
+    uint64_t hash = shm_key(key) ^ ((uint64_t)(kind + 1) * 0x9e3779b97f4a7c15ULL);
+    return hash == 0 ? 1 : hash;
+}
+
+/// @brief Try to take a slot for writing. A slot left locked by a writer that was killed
+///  mid-write (a CGI timeout's SIGKILL) is taken over once it's been locked too long.
+/// @return The (odd) sequence number it now has, or 0 if another writer has it
+static uint32_t write_lock(struct cache_slot *slot, uint64_t now)
+{
+    uint64_t word = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    uint32_t seq = (uint32_t)word;
+    if ((seq & 1) && (word >> 32) + CACHE_STALE_LOCK_S >= now)
+    {
+        return 0;
+    }
+
+    // Still odd if we're taking it over, so readers keep away while we rewrite it
+    uint32_t locked = seq & 1 ? seq + 2 : seq + 1;
+    if (!__atomic_compare_exchange_n(&slot->seq, &word, (now << 32) | locked, 0, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (seq & 1)
+    {
+        // Whatever the dead writer left is half-written; never let it be read
+        slot->expires = 0;
+    }
+    return locked;
+}
+
+static void write_unlock(struct cache_slot *slot, uint32_t locked_seq)
+{
+    __atomic_store_n(&slot->seq, (uint64_t)(locked_seq + 1), __ATOMIC_RELEASE);
+}
+
+int cache_get(enum cache_kind kind, const char *key, void *value, size_t size)
+{
+    uint32_t expires_in;
+    return cache_get_ttl(kind, key, value, size, &expires_in);
+}
+
+int cache_get_ttl(enum cache_kind kind, const char *key, void *value, size_t size, uint32_t *expires_in)
+{
+    if (strlen(key) >= CACHE_KEY_LEN || attach() != 0)
+    {
+        return -1;
+    }
+
+    uint64_t k = slot_key(kind, key);
+    uint64_t now = now_s();
+
+    for (int i = 0; i < CACHE_PROBE; i++)
+    {
+        struct cache_slot *slot = &seg->slots[(k + i) & (CACHE_SLOTS - 1)];
+
+        // A few tries in case we keep landing on a writer
+        for (int attempt = 0; attempt < 4; attempt++)
+        {
+            uint64_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (before & 1)
+            {
+                continue;
+            }
+
+            uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+            uint32_t slot_kind = __atomic_load_n(&slot->kind, __ATOMIC_RELAXED);
+            uint64_t expires = __atomic_load_n(&slot->expires, __ATOMIC_RELAXED);
+            uint32_t len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+            int match = slot_key == k && slot_kind == (uint32_t)kind && expires > now && len <= size &&
+                        len <= CACHE_VALUE_LEN && strncmp(slot->name, key, CACHE_KEY_LEN) == 0;
+            if (match)
+            {
+                memcpy(value, slot->value, len);
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != before)
+            {
+                continue;
+            }
+
+            if (match)
+            {
+                __atomic_add_fetch(&seg->hits[kind], 1, __ATOMIC_RELAXED);
+                *expires_in = (uint32_t)(expires - now);
+                return (int)len;
+            }
+            break;
+        }
+    }
+
+    __atomic_add_fetch(&seg->misses[kind], 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+void cache_put(enum cache_kind kind, const char *key, const void *value, size_t len, uint32_t ttl)
+{
+    if (len > CACHE_VALUE_LEN || strlen(key) >= CACHE_KEY_LEN || attach() != 0)
+    {
+        return;
+    }
+
+    uint64_t k = slot_key(kind, key);
+    uint64_t now = now_s();
+
+    // Prefer the slot already holding this key, then a stale one, then the one expiring soonest
+    struct cache_slot *victim = NULL;
+    for (int i = 0; i < CACHE_PROBE; i++)
+    {
+        struct cache_slot *slot = &seg->slots[(k + i) & (CACHE_SLOTS - 1)];
+        uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+        uint64_t expires = __atomic_load_n(&slot->expires, __ATOMIC_RELAXED);
+        if (slot_key == k)
+        {
+            victim = slot;
+            break;
+        }
+        if (victim == NULL || (victim->expires > now && expires < victim->expires))
+        {
+            victim = slot;
+        }
+    }
+
+    uint32_t locked = write_lock(victim, now);
+    if (locked == 0)
+    {
+        return;
+    }
+
+    victim->kind = kind;
+    victim->key = k;
+    strcpy(victim->name, key);
+    victim->expires = now + ttl;
+    victim->len = (uint32_t)len;
+    memcpy(victim->value, value, len);
+
+    write_unlock(victim, locked);
+}
+
+void cache_drop(enum cache_kind kind, const char *key)
+{
+    if (strlen(key) >= CACHE_KEY_LEN || attach() != 0)
+    {
+        return;
+    }
+
+    uint64_t k = slot_key(kind, key);
+    uint64_t now = now_s();
+    for (int i = 0; i < CACHE_PROBE; i++)
+    {
+        struct cache_slot *slot = &seg->slots[(k + i) & (CACHE_SLOTS - 1)];
+        if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) != k)
+        {
+            continue;
+        }
+
+        uint32_t locked = write_lock(slot, now);
+        if (locked != 0)
+        {
+            if (slot->key == k && slot->kind == (uint32_t)kind && strcmp(slot->name, key) == 0)
+            {
+                slot->expires = 0;
+            }
+            write_unlock(slot, locked);
+        }
+    }
+}
+
+uint32_t cache_ttl(void)
+{
+    const char *setting = getenv("CPWD_CACHE_TTL");
+    long ttl = setting == NULL ? -1 : strtol(setting, NULL, 10);
+    return ttl >= 0 ? (uint32_t)ttl : CACHE_DEFAULT_TTL;
+}
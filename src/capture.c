@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "request.h"
+
+/// Form parameters whose values never reach the log
+static const char *secret_params[] = {"token", NULL};
+
+/// The record being built for this request, NULL unless capturing
+static struct capture_record *record;
+static char *path;
+static char addr[CAPTURE_FIELD_MAX + 1];
+static char query[CAPTURE_FIELD_MAX + 1];
+static char body[CAPTURE_FIELD_MAX + 1];
+static uint64_t started_mono_ns;
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Copy a field, cut to CAPTURE_FIELD_MAX
+static uint16_t copy_field(char *dst, const char *src, size_t len)
+{
+    len = len > CAPTURE_FIELD_MAX ? CAPTURE_FIELD_MAX : len;
+    memcpy(dst, src, len);
+    dst[len] = 0;
+    return (uint16_t)len;
+}
+
+static void write_record(void)
+{
+    if (record == NULL)
+    {
+        return;
+    }
+
+    record->duration_us = (uint32_t)((now_ns(CLOCK_MONOTONIC) - started_mono_ns) / 1000ULL);
+
+    // One buffer and one write, so records from concurrent requests stay whole
+    size_t len = sizeof(*record) + record->addr_len + record->query_len + record->body_len;
+    char *buf = malloc(len);
+    if (buf == NULL)
+    {
+        return;
+    }
+
+    char *p = buf;
+    memcpy(p, record, sizeof(*record));
+    p += sizeof(*record);
+    memcpy(p, addr, record->addr_len);
+    p += record->addr_len;
+    memcpy(p, query, record->query_len);
+    p += record->query_len;
+    memcpy(p, body, record->body_len);
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd >= 0)
+    {
+        // Nothing useful to do about a short write; the reader stops at the torn record
+        ssize_t written = write(fd, buf, len);
+        (void)written;
+        close(fd);
+    }
+    free(buf);
+}
+
+void capture_begin(enum capture_mode mode)
+{
+    path = getenv("CPWD_CAPTURE");
+    if (path == NULL || *path == 0 || record != NULL)
+    {
+        return;
+    }
+
+    static struct capture_record rec;
+    record = &rec;
+    record->magic = CAPTURE_MAGIC;
+    record->mode = (uint8_t)mode;
+    record->result = 1;
+    record->start_ns = now_ns(CLOCK_REALTIME);
+    started_mono_ns = now_ns(CLOCK_MONOTONIC);
+
+    const char *remote_addr = getenv("REMOTE_ADDR");
+    const char *query_string = getenv("QUERY_STRING");
+    const char *content_length = getenv("CONTENT_LENGTH");
+    if (remote_addr != NULL)
+    {
+        record->addr_len = copy_field(addr, remote_addr, strlen(remote_addr));
+    }
+    if (query_string != NULL)
+    {
+        record->query_len = copy_field(query, query_string, strlen(query_string));
+        capture_redact(query);
+    }
+    record->content_length = content_length == NULL ? -1 : atoi(content_length);
+
+    atexit(write_record);
+}
+
+void capture_body(const char *data, size_t len)
+{
+    if (record == NULL)
+    {
+        return;
+    }
+    record->body_len = copy_field(body, data, len);
+    capture_redact(body);
+}
+
+void capture_result(int result)
+{
+    if (record != NULL)
+    {
+        record->result = result;
+    }
+}
+
+void capture_redact(char *data)
+{
+    for (const char **name = secret_params; *name != NULL; name++)
+    {
+        size_t len;
+        char *value = form_param(data, *name, &len);
+        if (value != NULL)
+        {
+            memset(value, 'x', len);
+        }
+    }
+}
+
+/// @brief Read one variable-length field
+static int read_field(FILE *log, char *dst, uint16_t len)
+{
+    if (len > CAPTURE_FIELD_MAX || fread(dst, 1, len, log) != len)
+    {
+        return -1;
+    }
+    dst[len] = 0;
+    return 0;
+}
+
+int capture_read(FILE *log, struct capture_record *rec, char *addr_out, char *query_out, char *body_out)
+{
+    size_t n = fread(rec, 1, sizeof(*rec), log);
+    if (n == 0 && feof(log))
+    {
+        return 0;
+    }
+    if (n != sizeof(*rec) || rec->magic != CAPTURE_MAGIC)
+    {
+        return -1;
+    }
+
+    if (read_field(log, addr_out, rec->addr_len) != 0 || read_field(log, query_out, rec->query_len) != 0 ||
+        read_field(log, body_out, rec->body_len) != 0)
+    {
+        return -1;
+    }
+    return 1;
+}
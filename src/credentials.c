@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "credentials.h"
+
+static const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+/// @brief Fill dst with n random alphanumeric characters (not terminated)
+static void random_alnum(char *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = alnum[rand() % 62];
+    }
+}
+
+void generate_token(char *token)
+{
+    random_alnum(token, TOKEN_LEN);
+    token[TOKEN_LEN] = 0;
+}
+
+void generate_password(char *password)
+{
+    random_alnum(password, PASSWORD_LEN - 4);
+    memcpy(password + PASSWORD_LEN - 4, "Aa1!", 5);
+}
+
+size_t unicode_pwd_encode(uint8_t *dst, const char *password)
+{
+    size_t out = 0;
+
+    // Quote and widen in one pass instead of building the quoted string first
+    dst[out++] = '"';
+    dst[out++] = 0;
+    for (const char *p = password; *p != 0; p++)
+    {
+        dst[out++] = (uint8_t)*p;
+        dst[out++] = 0;
+    }
+    dst[out++] = '"';
+    dst[out++] = 0;
+
+    return out;
+}
+
+int token_verify(const char *token, const char *contents)
+{
+    return strlen(token) == TOKEN_LEN && strstr(contents, token) != NULL;
+}
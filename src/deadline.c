@@ -0,0 +1,44 @@
+#include <stdlib.h>
+
+#include "deadline.h"
+
+void deadline_start(struct deadline *deadline, long budget_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, &deadline->end);
+    deadline->end.tv_sec += budget_ms / 1000;
+    deadline->end.tv_nsec += (budget_ms % 1000) * 1000000L;
+    if (deadline->end.tv_nsec >= 1000000000L)
+    {
+        deadline->end.tv_sec++;
+        deadline->end.tv_nsec -= 1000000000L;
+    }
+}
+
+void deadline_start_request(struct deadline *deadline)
+{
+    const char *budget = getenv("CPWD_DEADLINE_MS");
+    long budget_ms = budget == NULL ? 0 : strtol(budget, NULL, 10);
+    deadline_start(deadline, budget_ms > 0 ? budget_ms : DEADLINE_DEFAULT_MS);
+}
+
+long deadline_remaining_ms(const struct deadline *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long ms = (long)(deadline->end.tv_sec - now.tv_sec) * 1000 + (deadline->end.tv_nsec - now.tv_nsec) / 1000000L;
+    return ms > 0 ? ms : 0;
+}
+
+int deadline_timeval(const struct deadline *deadline, struct timeval *tv)
+{
+    long ms = deadline_remaining_ms(deadline);
+    if (ms == 0)
+    {
+        return -1;
+    }
+
+    tv->tv_sec = ms / 1000;
+    tv->tv_usec = (ms % 1000) * 1000;
+    return 0;
+}
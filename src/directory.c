@@ -0,0 +1,971 @@
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "directory.h"
+#include "dirsched.h"
+#include "plan.h"
+#include "trace.h"
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+/// @brief The libldap error code for a failed call on a connection
+static int ld_error(LDAP *ld)
+{
+    int err = LDAP_OTHER;
+    ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &err);
+    return err;
+}
+
+/// @brief Wait for the complete result of an operation, abandoning it at the deadline
+/// @param res Set to the result chain on success; the caller frees it
+/// @return LDAP_SUCCESS if a result arrived, otherwise an error code
+static int wait_result(LDAP *ld, int msgid, const struct deadline *deadline, LDAPMessage **res)
+{
+    struct timeval tv;
+    int type = 0;
+    if (deadline_timeval(deadline, &tv) == 0)
+    {
+        type = ldap_result(ld, msgid, LDAP_MSG_ALL, &tv, res);
+    }
+
+    if (type == 0)
+    {
+        ldap_abandon_ext(ld, msgid, NULL, NULL);
+        return LDAP_TIMEOUT;
+    }
+    if (type < 0)
+    {
+        return ld_error(ld);
+    }
+    return LDAP_SUCCESS;
+}
+
+/// @brief The result code carried by a result message; frees the message
+static int parse_and_free(LDAP *ld, LDAPMessage *res)
+{
+    int err = LDAP_OTHER;
+    int status = ldap_parse_result(ld, res, &err, NULL, NULL, NULL, NULL, 1);
+    return status != LDAP_SUCCESS ? status : err;
+}
+
+/// @brief Send a simple bind, with the connect bounded by the deadline
+/// @param msgid Set to the bind's message id
+static int send_bind(LDAP *ld, const char *bind_dn, const char *bind_pw, const struct deadline *deadline, int *msgid)
+{
+    struct timeval tv;
+    if (deadline_timeval(deadline, &tv) != 0)
+    {
+        return LDAP_TIMEOUT;
+    }
+    ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+
+    struct berval cred = {
+        .bv_len = strlen(bind_pw),
+        .bv_val = (char *)bind_pw,
+    };
+    return ldap_sasl_bind(ld, bind_dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, msgid);
+}
+
+/// One search for a single entry
+struct search
+{
+    const char *base;
+    int scope;
+    const char *filter;
+    const char *attr;
+};
+
+/// @brief Send the search for one entry
+static int send_search(LDAP *ld, const struct search *search, const struct deadline *deadline, int *msgid)
+{
+    // The remaining budget doubles as the server-side time limit
+    struct timeval tv;
+    if (deadline_timeval(deadline, &tv) != 0)
+    {
+        return LDAP_TIMEOUT;
+    }
+
+    // We only ever read the first entry, so ask AD not to build referrals to other domains.
+    //  Not critical, so other servers just ignore it.
+    LDAPControl domain_scope = {
+        .ldctl_oid = DIRECTORY_DOMAIN_SCOPE_OID,
+        .ldctl_value = {0, NULL},
+        .ldctl_iscritical = 0,
+    };
+
+    return ldap_search_ext(ld, search->base, search->scope, search->filter,
+                           (char *[]){(char *)search->attr, NULL}, 0, (LDAPControl *[]){&domain_scope, NULL}, NULL,
+                           &tv, 1, msgid);
+}
+
+/// @brief Copy the dn and the first value of attr from the first entry of a search result; frees the result
+static int first_value(LDAP *ld, LDAPMessage *res, const char *attr, char *value, size_t value_size, char *dn,
+                       size_t dn_size)
+{
+    LDAPMessage *entry = ldap_first_entry(ld, res);
+    if (entry == NULL)
+    {
+        int status = parse_and_free(ld, res);
+        return status != LDAP_SUCCESS ? status : LDAP_NO_SUCH_OBJECT;
+    }
+
+    // We asked for one entry, so sizeLimitExceeded with an entry in hand is fine
+    int status = LDAP_SUCCESS;
+    if (dn != NULL)
+    {
+        char *entry_dn = ldap_get_dn(ld, entry);
+        if (entry_dn == NULL || strlen(entry_dn) >= dn_size)
+        {
+            status = LDAP_NO_MEMORY;
+        }
+        else
+        {
+            strcpy(dn, entry_dn);
+        }
+        ldap_memfree(entry_dn);
+    }
+
+    struct berval **vals = ldap_get_values_len(ld, entry, attr);
+    if (vals == NULL || vals[0] == NULL)
+    {
+        status = status != LDAP_SUCCESS ? status : LDAP_NO_SUCH_ATTRIBUTE;
+    }
+    else if (vals[0]->bv_len >= value_size)
+    {
+        status = LDAP_NO_MEMORY;
+    }
+    else if (status == LDAP_SUCCESS)
+    {
+        memcpy(value, vals[0]->bv_val, vals[0]->bv_len);
+        value[vals[0]->bv_len] = 0;
+    }
+
+    ldap_value_free_len(vals);
+    ldap_msgfree(res);
+    return status;
+}
+
+/// @brief How long to give the primary before hedging the search onto a replica
+static long hedge_delay_ms(const struct directory *dir)
+{
+    const char *setting = getenv("CPWD_HEDGE_PERCENTILE");
+    int percentile = setting == NULL ? 0 : atoi(setting);
+    if (percentile < 1 || percentile > 99)
+    {
+        percentile = DIRECTORY_DEFAULT_HEDGE_PERCENTILE;
+    }
+
+    uint32_t ms = sched_latency_ms(dir->target, percentile);
+    return ms == 0 ? DIRECTORY_DEFAULT_HEDGE_MS : (long)ms;
+}
+
+/// @brief Race the primary's search against the same search on a replica
+/// @param msgid The primary's outstanding search
+/// @param winner Set to the connection whose result is returned in res
+static int hedged_result(struct directory *dir, int msgid, const struct search *search, LDAP **winner,
+                         LDAPMessage **res)
+{
+    struct timeval zero = {0, 0};
+    int primary_msgid = msgid;
+    int replica_msgid = -1;
+    int replica_searching = 0;
+
+    trace(TRACE_HEDGE, 0);
+    if (dir->replica != NULL)
+    {
+        // Left over from hedging an earlier search; its state is unknown, so start afresh
+        ldap_unbind_ext_s(dir->replica, NULL, NULL);
+        dir->replica = NULL;
+    }
+    if (ldap_initialize(&dir->replica, dir->replica_uri) != LDAP_SUCCESS ||
+        send_bind(dir->replica, dir->bind_dn, dir->bind_pw, dir->deadline, &replica_msgid) != LDAP_SUCCESS)
+    {
+        // No replica after all; just keep waiting on the primary
+        *winner = dir->ld;
+        return wait_result(dir->ld, msgid, dir->deadline, res);
+    }
+
+    while (primary_msgid >= 0 || replica_msgid >= 0)
+    {
+        struct pollfd fds[2];
+        int nfds = 0;
+        int primary_fd = -1;
+        int replica_fd = -1;
+        if (primary_msgid >= 0 && ldap_get_option(dir->ld, LDAP_OPT_DESC, &primary_fd) == LDAP_SUCCESS)
+        {
+            fds[nfds++] = (struct pollfd){.fd = primary_fd, .events = POLLIN};
+        }
+        if (replica_msgid >= 0 && ldap_get_option(dir->replica, LDAP_OPT_DESC, &replica_fd) == LDAP_SUCCESS)
+        {
+            fds[nfds++] = (struct pollfd){.fd = replica_fd, .events = POLLIN};
+        }
+
+        long remaining = deadline_remaining_ms(dir->deadline);
+        if (nfds == 0 || remaining == 0 || poll(fds, nfds, (int)remaining) <= 0)
+        {
+            break;
+        }
+
+        if (primary_msgid >= 0)
+        {
+            int type = ldap_result(dir->ld, primary_msgid, LDAP_MSG_ALL, &zero, res);
+            if (type > 0)
+            {
+                *winner = dir->ld;
+                primary_msgid = -1;
+                break;
+            }
+            if (type < 0)
+            {
+                primary_msgid = -1;
+            }
+        }
+
+        if (replica_msgid >= 0)
+        {
+            LDAPMessage *msg = NULL;
+            int type = ldap_result(dir->replica, replica_msgid, LDAP_MSG_ALL, &zero, &msg);
+            if (type > 0 && replica_searching)
+            {
+                *winner = dir->replica;
+                *res = msg;
+                replica_msgid = -1;
+                break;
+            }
+            if (type > 0)
+            {
+                // The replica's bind finished; send it the search
+                replica_msgid = -1;
+                if (parse_and_free(dir->replica, msg) == LDAP_SUCCESS &&
+                    send_search(dir->replica, search, dir->deadline, &replica_msgid) == LDAP_SUCCESS)
+                {
+                    replica_searching = 1;
+                }
+                else
+                {
+                    replica_msgid = -1;
+                }
+            }
+            else if (type < 0)
+            {
+                replica_msgid = -1;
+            }
+        }
+    }
+
+    // Cancel whichever side lost (or both, if we ran out of time)
+    if (primary_msgid >= 0)
+    {
+        ldap_abandon_ext(dir->ld, primary_msgid, NULL, NULL);
+    }
+    if (replica_msgid >= 0)
+    {
+        ldap_abandon_ext(dir->replica, replica_msgid, NULL, NULL);
+    }
+
+    if (*winner == NULL)
+    {
+        return deadline_remaining_ms(dir->deadline) == 0 ? LDAP_TIMEOUT : LDAP_SERVER_DOWN;
+    }
+    return LDAP_SUCCESS;
+}
+
+/// @brief Whether a bind failure means the server itself is unreachable. Running out of
+///  time doesn't count: that may just be this request's budget, not the server.
+static int server_failed(int status)
+{
+    return status == LDAP_SERVER_DOWN || status == LDAP_CONNECT_ERROR;
+}
+
+/// @brief Append a uri to a space-separated list
+static void append_uri(char *list, const char *uri, size_t len)
+{
+    size_t used = strlen(list);
+    snprintf(list + used, DIRECTORY_URI_LEN - used, "%s%.*s", used > 0 ? " " : "", (int)len, uri);
+}
+
+/// @brief Order the uri list so servers recently seen down come last, the one that failed
+///  longest ago (and so is likeliest to be back) first among them
+/// @param dst Output buffer for the reordered, space-separated list
+/// @param uris The configured list
+/// @return How many of the servers are currently believed to be up
+static int order_by_health(char *dst, size_t dst_size, const char *uris)
+{
+    struct
+    {
+        const char *uri;
+        size_t len;
+        uint32_t expires_in;
+    } down[DIRECTORY_MAX_TARGETS];
+    int n_down = 0;
+    char up[DIRECTORY_URI_LEN] = "";
+    char rest[DIRECTORY_URI_LEN] = "";
+    int healthy = 0;
+
+    while (*(uris += strspn(uris, " ")) != 0)
+    {
+        size_t len = strcspn(uris, " ");
+        char uri[DIRECTORY_URI_LEN];
+        snprintf(uri, sizeof(uri), "%.*s", (int)len, uris);
+
+        char seen[DIRECTORY_URI_LEN];
+        uint32_t expires_in = 0;
+        if (cache_get_ttl(CACHE_HEALTH, uri, seen, sizeof(seen), &expires_in) < 0)
+        {
+            healthy++;
+            append_uri(up, uris, len);
+        }
+        else if (n_down < DIRECTORY_MAX_TARGETS)
+        {
+            // Insertion sort: every mark has the same TTL, so the least left is the oldest
+            int i = n_down++;
+            for (; i > 0 && down[i - 1].expires_in > expires_in; i--)
+            {
+                down[i] = down[i - 1];
+            }
+            down[i].uri = uris;
+            down[i].len = len;
+            down[i].expires_in = expires_in;
+        }
+        else
+        {
+            append_uri(rest, uris, len);
+        }
+        uris += len;
+    }
+
+    for (int i = 0; i < n_down; i++)
+    {
+        append_uri(up, down[i].uri, down[i].len);
+    }
+    snprintf(dst, dst_size, "%s%s%s", up, *up != 0 && *rest != 0 ? " " : "", rest);
+    return healthy;
+}
+
+int dir_open(struct directory *dir, const char *uri, const char *base, const char *bind_dn, const char *bind_pw,
+             const struct deadline *deadline)
+{
+    memset(dir, 0, sizeof(*dir));
+    dir->bind_dn = bind_dn;
+    dir->bind_pw = bind_pw;
+    dir->deadline = deadline;
+    snprintf(dir->target, sizeof(dir->target), "%s+%s", uri, base);
+
+    // If every server failed recently, don't spend the request's budget finding out about
+    //  all of them again; just try the one that failed longest ago
+    int healthy = order_by_health(dir->uri, sizeof(dir->uri), uri);
+
+    // Try the servers one at a time, so we know which one failed. Whatever follows the one
+    //  that binds is a replica we can hedge onto.
+    int status = LDAP_SERVER_DOWN;
+    const char *next = dir->uri;
+    while (*(next += strspn(next, " ")) != 0 && deadline_remaining_ms(deadline) > 0)
+    {
+        size_t len = strcspn(next, " ");
+        char server[DIRECTORY_URI_LEN];
+        snprintf(server, sizeof(server), "%.*s", (int)len, next);
+        next += len;
+
+        status = ldap_initialize(&dir->ld, server);
+        if (status != LDAP_SUCCESS)
+        {
+            return status;
+        }
+
+        int msgid;
+        status = send_bind(dir->ld, bind_dn, bind_pw, deadline, &msgid);
+
+        LDAPMessage *res;
+        if (status == LDAP_SUCCESS)
+        {
+            status = wait_result(dir->ld, msgid, deadline, &res);
+        }
+        if (status == LDAP_SUCCESS)
+        {
+            status = parse_and_free(dir->ld, res);
+        }
+
+        if (!server_failed(status))
+        {
+            // Up, even if it didn't like our credentials
+            cache_drop(CACHE_HEALTH, server);
+            next += strspn(next, " ");
+            dir->replica_uri = *next != 0 ? next : NULL;
+            return status;
+        }
+
+        cache_put(CACHE_HEALTH, server, server, strlen(server) + 1, DIRECTORY_DOWN_TTL);
+        ldap_unbind_ext_s(dir->ld, NULL, NULL);
+        dir->ld = NULL;
+        if (healthy == 0)
+        {
+            break;
+        }
+    }
+    return status;
+}
+
+/// @brief Run one search, hedging onto a replica if the primary is slow
+static int search_one(struct directory *dir, const struct search *search, char *value, size_t value_size, char *dn,
+                      size_t dn_size)
+{
+    int msgid;
+    int status = send_search(dir->ld, search, dir->deadline, &msgid);
+    if (status != LDAP_SUCCESS)
+    {
+        return status;
+    }
+
+    LDAP *winner = dir->ld;
+    LDAPMessage *res = NULL;
+    long hedge_ms = hedge_delay_ms(dir);
+
+    if (dir->replica_uri == NULL || hedge_ms >= deadline_remaining_ms(dir->deadline))
+    {
+        status = wait_result(dir->ld, msgid, dir->deadline, &res);
+    }
+    else
+    {
+        // Give the primary its usual time first, then hedge
+        struct timeval tv = {
+            .tv_sec = hedge_ms / 1000,
+            .tv_usec = (hedge_ms % 1000) * 1000,
+        };
+        int type = ldap_result(dir->ld, msgid, LDAP_MSG_ALL, &tv, &res);
+        if (type > 0)
+        {
+            status = LDAP_SUCCESS;
+        }
+        else if (type < 0)
+        {
+            status = ld_error(dir->ld);
+        }
+        else
+        {
+            winner = NULL;
+            status = hedged_result(dir, msgid, search, &winner, &res);
+        }
+    }
+
+    if (status != LDAP_SUCCESS)
+    {
+        return status;
+    }
+
+    return first_value(winner, res, search->attr, value, value_size, dn, dn_size);
+}
+
+int dir_find(struct directory *dir, const char *base, const char *filter, const char *attr, char *value,
+             size_t value_size, char *dn, size_t dn_size)
+{
+    // The planner learns from where entries turn up, so always fetch the dn
+    char found_dn[DIRECTORY_DN_LEN];
+    struct plan_step steps[PLAN_STRATEGY_COUNT];
+    int n = plan_search(dir->target, base, steps);
+
+    int status = LDAP_NO_SUCH_OBJECT;
+    for (int i = 0; i < n && status == LDAP_NO_SUCH_OBJECT; i++)
+    {
+        struct search search = {
+            .base = steps[i].base,
+            .scope = steps[i].strategy == PLAN_ONE_LEVEL ? LDAP_SCOPE_ONELEVEL : LDAP_SCOPE_SUBTREE,
+            .filter = filter,
+            .attr = attr,
+        };
+
+        uint64_t start = now_ms();
+        status = search_one(dir, &search, value, value_size, found_dn, sizeof(found_dn));
+        uint32_t ms = (uint32_t)(now_ms() - start);
+
+        // noSuchObject is a miss either way: no entry, or a learned container that's gone
+        int found = status == LDAP_SUCCESS || status == LDAP_NO_SUCH_ATTRIBUTE;
+        if (found || status == LDAP_NO_SUCH_OBJECT)
+        {
+            plan_record(dir->target, base, steps[i].strategy, found ? found_dn : NULL, ms);
+
+            // The hedge delay is a percentile of full searches; a narrow step's few
+            //  milliseconds would drag it down until every full search hedged
+            if (steps[i].strategy == PLAN_FULL_SUBTREE)
+            {
+                sched_record_latency(dir->target, ms);
+            }
+        }
+    }
+
+    if (dn != NULL && (status == LDAP_SUCCESS || status == LDAP_NO_SUCH_ATTRIBUTE))
+    {
+        if (strlen(found_dn) >= dn_size)
+        {
+            return LDAP_NO_MEMORY;
+        }
+        strcpy(dn, found_dn);
+    }
+    return status;
+}
+
+/// Where one domain's side of dir_find_first() has got to
+enum probe_state
+{
+    PROBE_CONNECTING,
+    PROBE_BINDING,
+    PROBE_SEARCHING,
+    PROBE_DONE,
+};
+
+struct probe
+{
+    LDAP *ld;
+    int msgid;
+    enum probe_state state;
+    /// The server asked, for the health cache
+    char server[DIRECTORY_URI_LEN];
+    /// "<uri>+<base>", for latency history and the planner
+    char target[DIRECTORY_URI_LEN * 2];
+    uint64_t search_start;
+};
+
+/// @brief Finish a probe that has failed or been answered
+static void probe_done(struct probe *probe, struct dir_target *target, int status)
+{
+    if (server_failed(status) && probe->server[0] != 0)
+    {
+        cache_put(CACHE_HEALTH, probe->server, probe->server, strlen(probe->server) + 1, DIRECTORY_DOWN_TTL);
+    }
+    target->status = status;
+    probe->state = PROBE_DONE;
+}
+
+/// @brief Send (or, while the connect is still in progress, retry sending) a probe's bind
+static void probe_bind(struct probe *probe, struct dir_target *target, const struct deadline *deadline)
+{
+    int status = send_bind(probe->ld, target->bind_dn, target->bind_pw, deadline, &probe->msgid);
+    if (status == LDAP_SUCCESS)
+    {
+        probe->state = PROBE_BINDING;
+    }
+    else if (status == LDAP_X_CONNECTING)
+    {
+        probe->state = PROBE_CONNECTING;
+    }
+    else
+    {
+        probe_done(probe, target, status);
+    }
+}
+
+/// @brief Connect to a domain's healthiest server without waiting for the connect
+static void probe_start(struct probe *probe, struct dir_target *target, const struct deadline *deadline)
+{
+    memset(probe, 0, sizeof(*probe));
+    probe->msgid = -1;
+    snprintf(probe->target, sizeof(probe->target), "%s+%s", target->uri, target->base);
+
+    // The healthiest server, or if they're all down, the one that failed longest ago
+    char ordered[DIRECTORY_URI_LEN];
+    order_by_health(ordered, sizeof(ordered), target->uri);
+    snprintf(probe->server, sizeof(probe->server), "%.*s", (int)strcspn(ordered, " "), ordered);
+
+    int status = ldap_initialize(&probe->ld, probe->server);
+    if (status != LDAP_SUCCESS)
+    {
+        probe_done(probe, target, status);
+        return;
+    }
+    ldap_set_option(probe->ld, LDAP_OPT_CONNECT_ASYNC, LDAP_OPT_ON);
+    probe_bind(probe, target, deadline);
+}
+
+/// @brief Unbind a probe's connection. libldap writes the unbind even to a socket whose
+///  connect was refused, so hold SIGPIPE off while that write fails.
+static void probe_close(struct probe *probe)
+{
+    sigset_t pipe_signal;
+    sigset_t old_mask;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+    ldap_unbind_ext_s(probe->ld, NULL, NULL);
+    probe->ld = NULL;
+
+    // Throw away the SIGPIPE if there was one, before unblocking it
+    struct timespec zero = {0, 0};
+    sigtimedwait(&pipe_signal, NULL, &zero);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/// @brief Move a probe on while it's connecting or binding
+/// @param revents What poll() said about the connection
+/// @return 1 if the bind has just succeeded and the probe is ready for its operation, 0 otherwise
+static int probe_bound(struct probe *probe, struct dir_target *target, short revents,
+                       const struct deadline *deadline)
+{
+    if (probe->state == PROBE_CONNECTING)
+    {
+        // A refused connect also polls writable; retrying the bind on it would raise SIGPIPE
+        if (revents & (POLLERR | POLLHUP))
+        {
+            probe_done(probe, target, LDAP_CONNECT_ERROR);
+            return 0;
+        }
+        probe_bind(probe, target, deadline);
+        return 0;
+    }
+
+    struct timeval zero = {0, 0};
+    LDAPMessage *res = NULL;
+    int type = ldap_result(probe->ld, probe->msgid, LDAP_MSG_ALL, &zero, &res);
+    if (type == 0)
+    {
+        return 0;
+    }
+    probe->msgid = -1;
+
+    int status = type < 0 ? ld_error(probe->ld) : parse_and_free(probe->ld, res);
+    if (status != LDAP_SUCCESS)
+    {
+        probe_done(probe, target, status);
+        return 0;
+    }
+    cache_drop(CACHE_HEALTH, probe->server);
+    probe->state = PROBE_SEARCHING;
+    return 1;
+}
+
+/// @brief Wait until any of the probes still going has something to do
+/// @param revents Set to what poll() said about each probe's connection; 0 for the rest
+/// @return How many probes are still going, or 0 once none are or the deadline has passed
+static int probes_wait(struct probe *probes, struct dir_target *targets, int n, short *revents,
+                       const struct deadline *deadline)
+{
+    // A connect in progress is ready once its socket is writable; anything else once
+    //  there's a response to read
+    struct pollfd fds[DIRECTORY_MAX_TARGETS];
+    int nfds = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int fd = -1;
+        revents[i] = 0;
+        if (probes[i].state != PROBE_DONE && ldap_get_option(probes[i].ld, LDAP_OPT_DESC, &fd) == LDAP_SUCCESS &&
+            fd >= 0)
+        {
+            short events = probes[i].state == PROBE_CONNECTING ? POLLOUT : POLLIN;
+            fds[nfds++] = (struct pollfd){.fd = fd, .events = events};
+        }
+        else if (probes[i].state != PROBE_DONE)
+        {
+            probe_done(&probes[i], &targets[i], LDAP_SERVER_DOWN);
+        }
+    }
+
+    long remaining = deadline_remaining_ms(deadline);
+    if (nfds == 0 || remaining == 0 || poll(fds, nfds, (int)remaining) <= 0)
+    {
+        return 0;
+    }
+
+    // Polled in the same order as the probes that are still going
+    int polled = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (probes[i].state != PROBE_DONE)
+        {
+            revents[i] = fds[polled++].revents;
+        }
+    }
+    return nfds;
+}
+
+/// @brief Abandon whatever the probes still have outstanding and close their connections
+/// @param status What to report for the domains that hadn't finished
+static void probes_finish(struct probe *probes, struct dir_target *targets, int n, int status)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (probes[i].state != PROBE_DONE)
+        {
+            if (probes[i].msgid >= 0)
+            {
+                ldap_abandon_ext(probes[i].ld, probes[i].msgid, NULL, NULL);
+            }
+            targets[i].status = status;
+        }
+        if (probes[i].ld != NULL)
+        {
+            probe_close(&probes[i]);
+        }
+    }
+}
+
+/// @brief Move a dir_find_first() probe on if its connection has something for it
+/// @return 1 if this probe found an acceptable entry, 0 otherwise
+static int find_step(struct probe *probe, struct dir_target *target, short revents, const char *filter,
+                     const char *attr, char *value, size_t value_size, char *dn, size_t dn_size,
+                     int (*accept)(void *context, const char *value), void *context,
+                     const struct deadline *deadline)
+{
+    if (probe->state != PROBE_SEARCHING)
+    {
+        if (probe_bound(probe, target, revents, deadline))
+        {
+            struct search search = {
+                .base = target->base,
+                .scope = LDAP_SCOPE_SUBTREE,
+                .filter = filter,
+                .attr = attr,
+            };
+            probe->search_start = now_ms();
+            int status = send_search(probe->ld, &search, deadline, &probe->msgid);
+            if (status != LDAP_SUCCESS)
+            {
+                probe_done(probe, target, status);
+            }
+        }
+        return 0;
+    }
+
+    struct timeval zero = {0, 0};
+    LDAPMessage *res = NULL;
+    int type = ldap_result(probe->ld, probe->msgid, LDAP_MSG_ALL, &zero, &res);
+    if (type == 0)
+    {
+        return 0;
+    }
+    probe->msgid = -1;
+    if (type < 0)
+    {
+        probe_done(probe, target, ld_error(probe->ld));
+        return 0;
+    }
+
+    uint32_t ms = (uint32_t)(now_ms() - probe->search_start);
+    sched_record_latency(probe->target, ms);
+
+    int status = first_value(probe->ld, res, attr, value, value_size, dn, dn_size);
+    if (status != LDAP_SUCCESS && status != LDAP_NO_SUCH_ATTRIBUTE)
+    {
+        probe_done(probe, target, status);
+        return 0;
+    }
+
+    // Teach the planner where this domain keeps its users, for the set-password that follows
+    plan_record(probe->target, target->base, PLAN_FULL_SUBTREE, dn, ms);
+
+    if (accept != NULL && (status != LDAP_SUCCESS || !accept(context, value)))
+    {
+        // Someone else's entry by the same name; leave it to the other domains
+        probe_done(probe, target, status == LDAP_SUCCESS ? LDAP_COMPARE_FALSE : status);
+        return 0;
+    }
+    probe_done(probe, target, status);
+    return 1;
+}
+
+int dir_find_first(struct dir_target *targets, int n, const char *filter, const char *attr, char *value,
+                   size_t value_size, char *dn, size_t dn_size, int (*accept)(void *context, const char *value),
+                   void *context, const struct deadline *deadline)
+{
+    struct probe probes[DIRECTORY_MAX_TARGETS];
+    short revents[DIRECTORY_MAX_TARGETS];
+    n = n < DIRECTORY_MAX_TARGETS ? n : DIRECTORY_MAX_TARGETS;
+
+    for (int i = 0; i < n; i++)
+    {
+        probe_start(&probes[i], &targets[i], deadline);
+    }
+
+    int winner = -1;
+    while (winner < 0 && probes_wait(probes, targets, n, revents, deadline) > 0)
+    {
+        for (int i = 0; i < n && winner < 0; i++)
+        {
+            if (revents[i] != 0 &&
+                find_step(&probes[i], &targets[i], revents[i], filter, attr, value, value_size, dn, dn_size, accept,
+                          context, deadline))
+            {
+                winner = i;
+            }
+        }
+    }
+
+    // Cancel the losers, or everything if we ran out of time
+    probes_finish(probes, targets, n, winner >= 0 ? LDAP_CANCELLED : LDAP_TIMEOUT);
+    return winner;
+}
+
+/// @brief Ask for the next page of a dir_scan()
+/// @param cookie Where the last page left off, or NULL for the first page
+static void scan_page(struct probe *probe, struct dir_target *target, const struct dir_scan *scan,
+                      struct berval *cookie, const struct deadline *deadline)
+{
+    if (deadline_remaining_ms(deadline) == 0)
+    {
+        probe_done(probe, target, LDAP_TIMEOUT);
+        return;
+    }
+
+    LDAPControl *page = NULL;
+    int status = ldap_create_page_control(probe->ld, scan->page_size, cookie, 0, &page);
+    if (status == LDAP_SUCCESS)
+    {
+        status = ldap_search_ext(probe->ld, target->base, LDAP_SCOPE_SUBTREE, scan->filter, scan->attrs, 0,
+                                 (LDAPControl *[]){page, NULL}, NULL, NULL, LDAP_NO_LIMIT, &probe->msgid);
+        ldap_control_free(page);
+    }
+    if (status != LDAP_SUCCESS)
+    {
+        probe_done(probe, target, status);
+    }
+}
+
+/// @brief Finish a page of a dir_scan(): ask for the next one, or stop if it was the last
+static void scan_page_done(struct probe *probe, struct dir_target *target, const struct dir_scan *scan,
+                           LDAPMessage *res, const struct deadline *deadline)
+{
+    probe->msgid = -1;
+
+    int err = LDAP_OTHER;
+    LDAPControl **controls = NULL;
+    int status = ldap_parse_result(probe->ld, res, &err, NULL, NULL, NULL, &controls, 1);
+    status = status != LDAP_SUCCESS ? status : err;
+
+    // A server that ignores the (non-critical) paging control sends everything in one go
+    struct berval cookie = {0, NULL};
+    LDAPControl *page = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, controls, NULL);
+    ber_int_t estimate;
+    if (status == LDAP_SUCCESS && page != NULL)
+    {
+        status = ldap_parse_pageresponse_control(probe->ld, page, &estimate, &cookie);
+    }
+    ldap_controls_free(controls);
+
+    if (status != LDAP_SUCCESS || cookie.bv_len == 0)
+    {
+        probe_done(probe, target, status);
+    }
+    else
+    {
+        scan_page(probe, target, scan, &cookie, deadline);
+    }
+    ber_memfree(cookie.bv_val);
+}
+
+/// @brief Move a dir_scan() probe on, handing over every entry that has arrived
+static void scan_step(struct probe *probe, struct dir_target *target, int index, short revents,
+                      const struct dir_scan *scan, const struct deadline *deadline)
+{
+    if (probe->state != PROBE_SEARCHING)
+    {
+        if (probe_bound(probe, target, revents, deadline))
+        {
+            scan_page(probe, target, scan, NULL, deadline);
+        }
+        return;
+    }
+
+    // Take the page one message at a time, so only the entry in hand is ever decoded
+    struct timeval zero = {0, 0};
+    LDAPMessage *msg = NULL;
+    int type;
+    while (probe->state == PROBE_SEARCHING &&
+           (type = ldap_result(probe->ld, probe->msgid, LDAP_MSG_ONE, &zero, &msg)) != 0)
+    {
+        if (type < 0)
+        {
+            probe_done(probe, target, ld_error(probe->ld));
+            return;
+        }
+        if (type == LDAP_RES_SEARCH_RESULT)
+        {
+            scan_page_done(probe, target, scan, msg, deadline);
+            continue;
+        }
+        if (type == LDAP_RES_SEARCH_ENTRY)
+        {
+            scan->entry(scan->context, index, probe->ld, msg);
+        }
+        ldap_msgfree(msg);
+    }
+}
+
+int dir_scan_all(struct dir_target *targets, int n, const struct dir_scan *scan, const struct deadline *deadline)
+{
+    struct probe probes[DIRECTORY_MAX_TARGETS];
+    short revents[DIRECTORY_MAX_TARGETS];
+    n = n < DIRECTORY_MAX_TARGETS ? n : DIRECTORY_MAX_TARGETS;
+
+    for (int i = 0; i < n; i++)
+    {
+        probe_start(&probes[i], &targets[i], deadline);
+    }
+
+    while (probes_wait(probes, targets, n, revents, deadline) > 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (revents[i] != 0)
+            {
+                scan_step(&probes[i], &targets[i], i, revents[i], scan, deadline);
+            }
+        }
+    }
+
+    probes_finish(probes, targets, n, LDAP_TIMEOUT);
+
+    int complete = 0;
+    for (int i = 0; i < n; i++)
+    {
+        complete += targets[i].status == LDAP_SUCCESS;
+    }
+    return complete;
+}
+
+int dir_modify(struct directory *dir, const char *dn, LDAPMod **mods)
+{
+    if (deadline_remaining_ms(dir->deadline) == 0)
+    {
+        return LDAP_TIMEOUT;
+    }
+
+    int msgid;
+    int status = ldap_modify_ext(dir->ld, dn, mods, NULL, NULL, &msgid);
+    if (status != LDAP_SUCCESS)
+    {
+        return status;
+    }
+
+    LDAPMessage *res;
+    status = wait_result(dir->ld, msgid, dir->deadline, &res);
+    if (status != LDAP_SUCCESS)
+    {
+        return status;
+    }
+    return parse_and_free(dir->ld, res);
+}
+
+int dir_close(struct directory *dir)
+{
+    if (dir->replica != NULL)
+    {
+        ldap_unbind_ext_s(dir->replica, NULL, NULL);
+        dir->replica = NULL;
+    }
+
+    int status = LDAP_SUCCESS;
+    if (dir->ld != NULL)
+    {
+        status = ldap_unbind_ext_s(dir->ld, NULL, NULL);
+        dir->ld = NULL;
+    }
+    return status;
+}
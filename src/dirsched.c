@@ -0,0 +1,446 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirsched.h"
+
+static struct sched_segment *seg;
+
+/// The domain and waiter entry this process holds, or NULL
+static struct sched_domain *held_domain;
+static struct sched_waiter *held_waiter;
+static uint64_t held_since_ns;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Read a positive integer setting from the environment
+static uint32_t env_setting(const char *name, uint32_t fallback)
+{
+    const char *value = getenv(name);
+    long parsed = value == NULL ? 0 : strtol(value, NULL, 10);
+    return parsed > 0 ? (uint32_t)parsed : fallback;
+}
+
+static void sched_init(void *segment)
+{
+    struct sched_segment *s = segment;
+
+    // The lock outlives any one process, so it must be shared and robust against a
+    //  CGI process being killed while holding it.
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&s->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    s->slots = env_setting("CPWD_SCHED_SLOTS", SCHED_DEFAULT_SLOTS);
+    s->domain_cap = env_setting("CPWD_SCHED_DOMAIN_CAP", SCHED_DEFAULT_DOMAIN_CAP);
+    s->wait_ms = env_setting("CPWD_SCHED_WAIT_MS", SCHED_DEFAULT_WAIT_MS);
+}
+
+/// @brief Free entries left behind by processes that died without releasing them
+static void reap(void)
+{
+    for (int d = 0; d < SCHED_DOMAINS; d++)
+    {
+        struct sched_domain *domain = &seg->domains[d];
+        if (domain->in_flight == 0 && domain->queued == 0)
+        {
+            continue;
+        }
+
+        for (int w = 0; w < SCHED_WAITERS; w++)
+        {
+            struct sched_waiter *waiter = &domain->waiters[w];
+            if (waiter->state == SCHED_FREE || kill(waiter->pid, 0) == 0 || errno != ESRCH)
+            {
+                continue;
+            }
+
+            if (waiter->state == SCHED_RUNNING)
+            {
+                domain->in_flight--;
+                seg->in_use--;
+            }
+            else
+            {
+                domain->queued--;
+            }
+            waiter->state = SCHED_FREE;
+        }
+    }
+}
+
+static int lock(void)
+{
+    int status = pthread_mutex_lock(&seg->lock);
+    if (status == EOWNERDEAD)
+    {
+        // Whoever held it died mid-update; the counters are still usable
+        pthread_mutex_consistent(&seg->lock);
+        reap();
+        status = 0;
+    }
+    return status;
+}
+
+/// @brief Find the domain entry for a name, claiming (or recycling) one if it's new
+static struct sched_domain *find_domain(const char *name)
+{
+    uint64_t key = shm_key(name);
+    struct sched_domain *idle = NULL;
+
+    for (int i = 0; i < SCHED_DOMAINS; i++)
+    {
+        struct sched_domain *domain = &seg->domains[(key + i) % SCHED_DOMAINS];
+        if (domain->key == key)
+        {
+            return domain;
+        }
+        if (domain->key == 0)
+        {
+            idle = domain;
+            break;
+        }
+        if (domain->in_flight == 0 && domain->queued == 0 &&
+            (idle == NULL || domain->last_used_ns < idle->last_used_ns))
+        {
+            idle = domain;
+        }
+    }
+
+    if (idle != NULL)
+    {
+        memset(idle, 0, sizeof(*idle));
+        idle->key = key;
+        strncpy(idle->name, name, SCHED_NAME_LEN - 1);
+    }
+    return idle;
+}
+
+/// @brief What one request of this domain costs, in ms of expected service time
+static int32_t cost(const struct sched_domain *domain)
+{
+    // Capped so one very slow domain can't make the scheduler spin for many rounds
+    uint32_t ms = domain->service_ms == 0 ? 1 : domain->service_ms;
+    return ms > SCHED_QUANTUM_MS * 8 ? SCHED_QUANTUM_MS * 8 : (int32_t)ms;
+}
+
+static int eligible(const struct sched_domain *domain)
+{
+    return domain->queued > 0 && domain->in_flight < seg->domain_cap;
+}
+
+static void advance(void)
+{
+    seg->rr = (seg->rr + 1) % SCHED_DOMAINS;
+    seg->rr_charged = 0;
+}
+
+/// @brief Hand the oldest waiter of a domain a slot
+static void grant(struct sched_domain *domain)
+{
+    struct sched_waiter *oldest = NULL;
+    for (int w = 0; w < SCHED_WAITERS; w++)
+    {
+        struct sched_waiter *waiter = &domain->waiters[w];
+        if (waiter->state == SCHED_WAITING && (oldest == NULL || waiter->enqueued_ns < oldest->enqueued_ns))
+        {
+            oldest = waiter;
+        }
+    }
+
+    oldest->state = SCHED_RUNNING;
+    domain->queued--;
+    domain->in_flight++;
+    seg->in_use++;
+}
+
+/// @brief Deficit round robin: give free slots to waiting domains in turn
+static void dispatch(void)
+{
+    int idle = 0;
+    int granted = 0;
+
+    while (seg->in_use < seg->slots && idle < SCHED_DOMAINS)
+    {
+        struct sched_domain *domain = &seg->domains[seg->rr];
+        if (!eligible(domain))
+        {
+            // Unused credit doesn't carry over once a domain's queue drains
+            if (domain->queued == 0)
+            {
+                domain->deficit_ms = 0;
+            }
+            advance();
+            idle++;
+            continue;
+        }
+
+        idle = 0;
+        if (!seg->rr_charged)
+        {
+            domain->deficit_ms += SCHED_QUANTUM_MS;
+            seg->rr_charged = 1;
+        }
+
+        if (domain->deficit_ms < cost(domain))
+        {
+            advance();
+            continue;
+        }
+
+        domain->deficit_ms -= cost(domain);
+        grant(domain);
+        granted = 1;
+    }
+
+    if (granted)
+    {
+        shm_wake(&seg->grants);
+    }
+}
+
+/// @brief Take this process's entry out of its domain
+static void remove_waiter(struct sched_domain *domain, struct sched_waiter *waiter)
+{
+    if (waiter->state == SCHED_RUNNING)
+    {
+        domain->in_flight--;
+        seg->in_use--;
+    }
+    else if (waiter->state == SCHED_WAITING)
+    {
+        domain->queued--;
+    }
+    waiter->state = SCHED_FREE;
+}
+
+static void release_at_exit(void)
+{
+    sched_release();
+}
+
+/// @brief Map the segment on first use
+/// @return 0, or -1 if scheduling is unavailable
+static int attach(void)
+{
+    if (seg == NULL)
+    {
+        seg = shm_attach(SCHED_SHM_NAME, sizeof(struct sched_segment), SCHED_MAGIC, sched_init);
+        if (seg == NULL)
+        {
+            return -1;
+        }
+        atexit(release_at_exit);
+    }
+    return 0;
+}
+
+int sched_acquire(const char *name, long max_wait_ms)
+{
+    if (attach() != 0 || held_domain != NULL || lock() != 0)
+    {
+        return 0;
+    }
+
+    // Clean up after requests the web server killed while they waited or ran, before their
+    //  entries make the queue look full
+    reap();
+
+    struct sched_domain *domain = find_domain(name);
+    struct sched_waiter *waiter = NULL;
+    for (int w = 0; domain != NULL && w < SCHED_WAITERS && waiter == NULL; w++)
+    {
+        if (domain->waiters[w].state == SCHED_FREE)
+        {
+            waiter = &domain->waiters[w];
+        }
+    }
+
+    if (domain == NULL)
+    {
+        // Every entry is busy with other domains; don't hold this request hostage
+        pthread_mutex_unlock(&seg->lock);
+        return 0;
+    }
+
+    if (waiter == NULL)
+    {
+        // This domain's queue is already full
+        domain->rejected++;
+        pthread_mutex_unlock(&seg->lock);
+        return -1;
+    }
+
+    uint64_t start = now_ns();
+    waiter->pid = getpid();
+    waiter->state = SCHED_WAITING;
+    waiter->enqueued_ns = start;
+    domain->queued++;
+    domain->last_used_ns = start;
+    dispatch();
+
+    long wait_ms = (long)seg->wait_ms < max_wait_ms ? (long)seg->wait_ms : max_wait_ms;
+    uint64_t until = start + (uint64_t)wait_ms * 1000000ULL;
+
+    // Sleep outside the lock until a grant, so being killed mid-wait leaves nothing behind
+    uint64_t now;
+    while (waiter->state == SCHED_WAITING && (now = now_ns()) < until)
+    {
+        uint32_t seen = __atomic_load_n(&seg->grants, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&seg->lock);
+        shm_wait(&seg->grants, seen, (long)((until - now + 999999ULL) / 1000000ULL));
+        if (lock() != 0)
+        {
+            // Our entry is reaped once this process has gone
+            return -1;
+        }
+
+        // A waiter killed since may have just been granted a slot it will never use
+        reap();
+        dispatch();
+    }
+
+    if (waiter->state != SCHED_RUNNING)
+    {
+        remove_waiter(domain, waiter);
+        domain->rejected++;
+        pthread_mutex_unlock(&seg->lock);
+        return -1;
+    }
+
+    uint64_t waited = now_ns() - start;
+    domain->served++;
+    domain->wait_total_ns += waited;
+    if (waited > domain->wait_max_ns)
+    {
+        domain->wait_max_ns = waited;
+    }
+    pthread_mutex_unlock(&seg->lock);
+
+    held_domain = domain;
+    held_waiter = waiter;
+    held_since_ns = now_ns();
+    return 0;
+}
+
+void sched_release(void)
+{
+    if (held_domain == NULL || lock() != 0)
+    {
+        return;
+    }
+
+    // A reaper may have freed the entry if we were presumed dead; only undo what's still ours
+    if (held_waiter->state == SCHED_RUNNING && held_waiter->pid == getpid())
+    {
+        uint32_t ms = (uint32_t)((now_ns() - held_since_ns) / 1000000ULL);
+        held_domain->service_ms = held_domain->service_ms == 0 ? ms : (held_domain->service_ms * 7 + ms) / 8;
+        held_domain->last_used_ns = now_ns();
+        remove_waiter(held_domain, held_waiter);
+
+        // Don't hand the slot to a waiter that was killed while it queued
+        reap();
+        dispatch();
+    }
+
+    pthread_mutex_unlock(&seg->lock);
+    held_domain = NULL;
+    held_waiter = NULL;
+}
+
+void sched_record_latency(const char *name, uint32_t ms)
+{
+    if (attach() != 0 || lock() != 0)
+    {
+        return;
+    }
+
+    struct sched_domain *domain = find_domain(name);
+    if (domain != NULL)
+    {
+        int bucket = 0;
+        while (bucket < SCHED_HIST_BUCKETS - 1 && ms >= (1u << bucket))
+        {
+            bucket++;
+        }
+        domain->search_hist[bucket]++;
+
+        uint32_t total = 0;
+        for (int i = 0; i < SCHED_HIST_BUCKETS; i++)
+        {
+            total += domain->search_hist[i];
+        }
+        if (total >= SCHED_HIST_MAX)
+        {
+            for (int i = 0; i < SCHED_HIST_BUCKETS; i++)
+            {
+                domain->search_hist[i] /= 2;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&seg->lock);
+}
+
+uint32_t sched_latency_ms(const char *name, int percentile)
+{
+    if (attach() != 0)
+    {
+        return 0;
+    }
+
+    // Look the domain up without claiming an entry; a racy read is fine for an estimate
+    uint64_t key = shm_key(name);
+    const struct sched_domain *domain = NULL;
+    for (int i = 0; i < SCHED_DOMAINS && domain == NULL; i++)
+    {
+        const struct sched_domain *candidate = &seg->domains[(key + i) % SCHED_DOMAINS];
+        if (candidate->key == 0)
+        {
+            break;
+        }
+        if (candidate->key == key)
+        {
+            domain = candidate;
+        }
+    }
+    if (domain == NULL)
+    {
+        return 0;
+    }
+
+    uint32_t hist[SCHED_HIST_BUCKETS];
+    uint32_t total = 0;
+    for (int i = 0; i < SCHED_HIST_BUCKETS; i++)
+    {
+        hist[i] = __atomic_load_n(&domain->search_hist[i], __ATOMIC_RELAXED);
+        total += hist[i];
+    }
+    if (total < SCHED_HIST_MIN_SAMPLES)
+    {
+        return 0;
+    }
+
+    uint32_t want = (total * (uint32_t)percentile + 99) / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < SCHED_HIST_BUCKETS; i++)
+    {
+        seen += hist[i];
+        if (seen >= want)
+        {
+            return 1u << i;
+        }
+    }
+    return 1u << (SCHED_HIST_BUCKETS - 1);
+}
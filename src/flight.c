@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flight.h"
+
+/// How often a waiter checks that the leader is still alive
+#define FLIGHT_POLL_MS 100
+
+static struct flight_segment *seg;
+
+/// The entry this process leads, or NULL
+static struct flight_entry *led_entry;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void flight_init(void *segment)
+{
+    struct flight_segment *s = segment;
+
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&s->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    const char *setting = getenv("CPWD_FLIGHT_WINDOW_S");
+    long window = setting == NULL ? -1 : strtol(setting, NULL, 10);
+    s->window_s = window >= 0 ? (uint32_t)window : FLIGHT_DEFAULT_WINDOW_S;
+}
+
+/// @brief Free entries whose leader died without finishing
+static void reap(void)
+{
+    int freed = 0;
+    for (int i = 0; i < FLIGHT_SLOTS; i++)
+    {
+        struct flight_entry *entry = &seg->entries[i];
+        if (entry->state == FLIGHT_RUNNING && kill(entry->owner, 0) != 0 && errno == ESRCH)
+        {
+            entry->state = FLIGHT_FREE;
+            freed = 1;
+        }
+    }
+    if (freed)
+    {
+        shm_wake(&seg->changes);
+    }
+}
+
+static int lock(void)
+{
+    int status = pthread_mutex_lock(&seg->lock);
+    if (status == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&seg->lock);
+        reap();
+        status = 0;
+    }
+    return status;
+}
+
+/// @brief Give up the entry this process leads, so a waiting duplicate can take over
+static void abandon(void)
+{
+    if (led_entry == NULL || lock() != 0)
+    {
+        return;
+    }
+
+    if (led_entry->state == FLIGHT_RUNNING && led_entry->owner == getpid())
+    {
+        led_entry->state = FLIGHT_FREE;
+        shm_wake(&seg->changes);
+    }
+
+    pthread_mutex_unlock(&seg->lock);
+    led_entry = NULL;
+}
+
+static int attach(void)
+{
+    if (seg == NULL)
+    {
+        seg = shm_attach(FLIGHT_SHM_NAME, sizeof(struct flight_segment), FLIGHT_MAGIC, flight_init);
+        if (seg == NULL)
+        {
+            return -1;
+        }
+        atexit(abandon);
+    }
+    return 0;
+}
+
+/// @brief The entry holding a key, or else one that's free to claim for it
+static struct flight_entry *find_entry(uint64_t key, uint64_t now_s)
+{
+    struct flight_entry *claimable = NULL;
+    for (int i = 0; i < FLIGHT_PROBE; i++)
+    {
+        struct flight_entry *entry = &seg->entries[(key + i) % FLIGHT_SLOTS];
+        if (entry->key == key && entry->state != FLIGHT_FREE)
+        {
+            return entry;
+        }
+
+        int stale = entry->state == FLIGHT_FREE ||
+                    (entry->state == FLIGHT_DONE && entry->done_s + seg->window_s <= now_s);
+        if (claimable == NULL && stale)
+        {
+            claimable = entry;
+        }
+    }
+    return claimable;
+}
+
+enum flight_role flight_begin(const char *key, const char *email, long max_wait_ms, char *token)
+{
+    if (attach() != 0 || led_entry != NULL || lock() != 0)
+    {
+        return FLIGHT_LEAD;
+    }
+
+    uint64_t k = shm_key(key);
+    uint64_t until = now_ns() + (uint64_t)(max_wait_ms > 0 ? max_wait_ms : 0) * 1000000ULL;
+    enum flight_role role = FLIGHT_LEAD;
+    int waited = 0;
+
+    for (;;)
+    {
+        uint64_t now = now_ns();
+        struct flight_entry *entry = find_entry(k, now / 1000000000ULL);
+        if (entry == NULL)
+        {
+            // Too many users in flight to track this one
+            break;
+        }
+
+        int fresh = entry->state == FLIGHT_DONE && entry->done_s + seg->window_s > now / 1000000000ULL;
+        int live = entry->key == k && (entry->state == FLIGHT_RUNNING || fresh);
+        int same = live && strncmp(entry->email, email, FLIGHT_EMAIL_LEN) == 0;
+        if (live && !same)
+        {
+            // Someone asked for a different address; don't share their result either way
+            break;
+        }
+
+        if (same && fresh)
+        {
+            role = waited ? FLIGHT_JOINED : FLIGHT_REUSED;
+            memcpy(token, entry->token, TOKEN_LEN + 1);
+            seg->joined += role == FLIGHT_JOINED;
+            seg->reused += role == FLIGHT_REUSED;
+            seg->searches_saved += entry->searched != 0;
+            seg->mails_saved++;
+            break;
+        }
+
+        if (same)
+        {
+            if (now >= until)
+            {
+                role = FLIGHT_BUSY;
+                break;
+            }
+
+            // Sleep outside the lock, so being killed mid-wait leaves nothing behind, and
+            //  wake up now and then to notice a leader that was killed outright
+            uint64_t wake = now + FLIGHT_POLL_MS * 1000000ULL;
+            wake = wake < until ? wake : until;
+            uint32_t seen = __atomic_load_n(&seg->changes, __ATOMIC_ACQUIRE);
+            pthread_mutex_unlock(&seg->lock);
+            shm_wait(&seg->changes, seen, (long)((wake - now + 999999ULL) / 1000000ULL));
+            if (lock() != 0)
+            {
+                return FLIGHT_LEAD;
+            }
+            reap();
+            waited = 1;
+            continue;
+        }
+
+        // Nobody has it (or the leader gave up); we lead
+        memset(entry, 0, sizeof(*entry));
+        entry->key = k;
+        entry->state = FLIGHT_RUNNING;
+        entry->owner = getpid();
+        strncpy(entry->email, email, FLIGHT_EMAIL_LEN - 1);
+        seg->led++;
+        led_entry = entry;
+        break;
+    }
+
+    pthread_mutex_unlock(&seg->lock);
+    return role;
+}
+
+void flight_end(const char *token, int searched)
+{
+    if (led_entry == NULL || lock() != 0)
+    {
+        return;
+    }
+
+    if (led_entry->state == FLIGHT_RUNNING && led_entry->owner == getpid())
+    {
+        memcpy(led_entry->token, token, TOKEN_LEN + 1);
+        led_entry->searched = searched != 0;
+        led_entry->done_s = now_ns() / 1000000000ULL;
+        led_entry->state = FLIGHT_DONE;
+        shm_wake(&seg->changes);
+    }
+
+    pthread_mutex_unlock(&seg->lock);
+    led_entry = NULL;
+}
+
+void flight_forget(const char *key)
+{
+    if (attach() != 0 || lock() != 0)
+    {
+        return;
+    }
+
+    uint64_t k = shm_key(key);
+    for (int i = 0; i < FLIGHT_PROBE; i++)
+    {
+        struct flight_entry *entry = &seg->entries[(k + i) % FLIGHT_SLOTS];
+        if (entry->key == k && entry->state == FLIGHT_DONE)
+        {
+            entry->state = FLIGHT_FREE;
+        }
+    }
+
+    pthread_mutex_unlock(&seg->lock);
+}
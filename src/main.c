@@ -4,285 +4,749 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <unistd.h>
 #include <time.h>
-
-#include <curl/curl.h>
+#include <sys/wait.h>
 
 #include <ldap.h>
 #include <lber.h>
 
-// For some reason, these functions are not defined in the header file
-//  Gosh, I hope I'm using buggy deprecated stuff.
+#include "audit.h"
+#include "cache.h"
+#include "capture.h"
+#include "credentials.h"
+#include "deadline.h"
+#include "directory.h"
+#include "dirsched.h"
+#include "flight.h"
+#include "request.h"
+#include "trace.h"
 
-/// Synchronous LDAP bind operation
-int ldap_bind_s(LDAP *ld, const char *who, const char *cred, int method);
+const char *service_account_cn = "service_account";
 
-/// Synchronoud LDAP unbind operation
-int ldap_unbind_s(LDAP *ld);
+#define SERVICE_PASSWORD_FILE ".password.service_account"
 
-char **ldap_get_values(LDAP *ld, LDAPMessage *entry, char *attr);
+/// Domains to look a user up in when the reset form doesn't name one, one "<uri>+<base>" per line
+#define DOMAINS_FILE ".domains"
 
-void ldap_value_free(char **vals);
+/// The mailer, unless CPWD_SENDMAIL names another; replays point that at a sink
+#ifndef SENDMAIL_PATH
+#define SENDMAIL_PATH "/usr/sbin/sendmail"
+#endif
 
-/// Global timeout for LDAP operations
-struct timeval timeout = {
-    .tv_sec = 5,
-    .tv_usec = 0,
-};
+/// The service account's password; outlives the directory connections that use it
+static char service_password[255];
 
-const char *service_account_cn = "service_account";
+/// The configured domains, each line split into uri and base in place, and their bind dns
+static char domain_lines[DIRECTORY_MAX_TARGETS][DIRECTORY_URI_LEN * 2];
+static char domain_bind_dns[DIRECTORY_MAX_TARGETS][DIRECTORY_URI_LEN * 2];
 
 /// @brief Exit the program with a status code
 /// @param status The status code to exit with
 /// @return void
 void print_and_quit(int status)
 {
+    trace(TRACE_FAIL, status);
+    capture_result(status);
     printf("FAIL! Exit code: %d\n", status);
     exit(0);
 }
 
-/// @brief Create a password reset link and email it to the user
-void email_user()
+/// @brief Quit if the request has used up its time budget
+/// @param deadline The request deadline
+/// @return void
+void require_budget(const struct deadline *deadline)
 {
-    // This is called as a cgi post request, so we need to read the username from the post data
-    //  and then look up the user's email address in LDAP.
-    // The post data should be supplied in stdin.
+    if (deadline_remaining_ms(deadline) == 0)
+    {
+        printf("Timed out, please try again in a minute\n");
+        print_and_quit(LDAP_TIMEOUT);
+    }
+}
 
-    // For now, just print stdin to stdout for debugging purposes.
+/// @brief Wait for our turn to talk to the target directory, so one slow domain can't use up
+///  every request slot
+/// @param ldap_uri The server uri
+/// @param ldap_base The base dn
+/// @param deadline The request deadline; we won't queue past it
+/// @return void; quits if the domain stays too busy
+void wait_for_directory(const char *ldap_uri, const char *ldap_base, const struct deadline *deadline)
+{
+    char target[DIRECTORY_URI_LEN * 2];
+    snprintf(target, sizeof(target), "%s+%s", ldap_uri, ldap_base);
 
-    // Read the length of the post data from the environment.
-    char *content_length_str = getenv("CONTENT_LENGTH");
-    if (content_length_str == NULL)
+    if (sched_acquire(target, deadline_remaining_ms(deadline)) != 0)
     {
-        printf("No content length\n");
-        exit(1);
+        trace(TRACE_QUEUE, LDAP_BUSY);
+        printf("The directory for this domain is busy, please try again in a minute\n");
+        print_and_quit(LDAP_BUSY);
     }
+    trace(TRACE_QUEUE, 0);
+}
 
-    // Convert the content length to an integer
-    int content_length = atoi(content_length_str);
+/// @brief The shared cache key for the service account's password: the password file's
+///  absolute path, since every install on the host shares the cache
+/// @return The key, or NULL if there's no password file here
+const char *password_cache_key()
+{
+    static char path[PATH_MAX];
+    return realpath(SERVICE_PASSWORD_FILE, path);
+}
 
-    // Allocate a buffer to read the post data into
-    char *post_data = malloc(content_length + 1);
-    if (post_data == NULL)
+/// @brief Read the service account's password, from the shared cache if another request read
+///  it recently
+/// @return void; quits if it can't be read
+void read_service_password()
+{
+    const char *key = password_cache_key();
+    if (key != NULL && cache_get(CACHE_SECRET, key, service_password, sizeof(service_password)) > 0)
     {
-        printf("Failed to allocate memory\n");
+        return;
+    }
+
+    // The password lives in a file in the working directory called ".password.service_account"
+    FILE *password_file = fopen(SERVICE_PASSWORD_FILE, "r");
+    if (password_file == NULL)
+    {
+        printf("Failed to open password file\n");
         exit(1);
     }
 
-    // Read the post data from stdin
-    int bytes_read = fread(post_data, 1, content_length, stdin);
-    if (bytes_read != content_length)
+    // Read one line from the password file
+    if (fgets(service_password, sizeof(service_password), password_file) == NULL)
     {
-        printf("Failed to read post data\n");
+        printf("Failed to read password\n");
         exit(1);
     }
+    fclose(password_file);
 
-    // Null-terminate the post data
-    post_data[content_length] = 0;
+    // Remove the newline from the password
+    char *newline = strchr(service_password, '\n');
+    if (newline != NULL)
+    {
+        *newline = 0;
+    }
 
-    // unescape the post data
-    CURL *curl = curl_easy_init();
-    if (curl == NULL)
+    if (key != NULL)
     {
-        printf("Failed to initialize curl\n");
-        exit(1);
+        cache_put(CACHE_SECRET, key, service_password, strlen(service_password) + 1, cache_ttl());
     }
+}
 
-    // We need to save the encoded server parameter to use it later.
-    char *server_param = strstr(post_data, "server=");
-    if (server_param == NULL)
+/// @brief Make the next read_service_password() read the file, after the directory turned
+///  the password down; it may have been rotated
+void forget_service_password()
+{
+    const char *key = password_cache_key();
+    if (key != NULL)
     {
-        printf("No server parameter found\n");
-        exit(1);
+        cache_drop(CACHE_SECRET, key);
     }
-    server_param += strlen("server=");
+}
 
-    int post_data_decoded_len;
-    char *post_data_decoded = curl_easy_unescape(curl, post_data, content_length, &post_data_decoded_len);
-    if (post_data_decoded == NULL)
+/// @brief Connect and bind to the target directory as the service account
+/// @param dir The directory to open
+/// @param ldap_uri The server uri
+/// @param ldap_base The base dn
+/// @param deadline The request deadline
+/// @return void; quits if the bind fails
+void open_directory(struct directory *dir, const char *ldap_uri, const char *ldap_base, const struct deadline *deadline)
+{
+    // Now, we need to determine the bind dn and password for the service account.
+    char *bind_dn = malloc(strlen("cn=") + strlen(service_account_cn) + strlen(",") + strlen(ldap_base) + 1);
+    if (bind_dn == NULL)
     {
-        printf("Failed to decode post data\n");
+        printf("Failed to allocate memory\n");
         exit(1);
     }
+    sprintf(bind_dn, "cn=%s,%s", service_account_cn, ldap_base);
 
-    // Now, the post data is in the format "userid=<username>&email=<email>&ldap_uri=<server_uri>+<server_basedn>"
-    //  We need to extract the username, email, and the ldap_uri uri and base dn from this string.
+    read_service_password();
 
-    // Find the username
-    char *username = strstr(post_data_decoded, "userid=");
-    if (username == NULL)
+    // Connect and bind to the server
+    int status = dir_open(dir, ldap_uri, ldap_base, bind_dn, service_password, deadline);
+
+    trace(TRACE_BIND, status);
+    if (status == LDAP_INVALID_CREDENTIALS)
     {
-        printf("No username found\n");
-        exit(1);
+        forget_service_password();
     }
-    username += strlen("userid=");
-    char *username_end = strchr(username, '&');
+    if (status != LDAP_SUCCESS)
+    {
+        printf("Failed to bind to LDAP\n");
+        print_and_quit(status);
+    }
+}
 
-    if (username_end == NULL)
+/// @brief The cache key for a user in a target directory
+void user_cache_key(char *key, size_t key_size, const char *ldap_uri, const char *ldap_base, const char *username)
+{
+    snprintf(key, key_size, "%s+%s:%s", ldap_uri, ldap_base, username);
+}
+
+/// @brief Look up a user's dn and email from a recent search, if there was one
+/// @param user_dn Output buffer for the dn
+/// @param ldap_email Output buffer for the email; empty if the user has none
+/// @return 0 if the user was cached, -1 otherwise
+int cached_user(const char *ldap_uri, const char *ldap_base, const char *username, char *user_dn, size_t dn_size,
+                char *ldap_email, size_t email_size)
+{
+    char key[DIRECTORY_URI_LEN * 2];
+    user_cache_key(key, sizeof(key), ldap_uri, ldap_base, username);
+
+    // Stored as "<dn>\n<email>"
+    char value[CACHE_VALUE_LEN];
+    if (cache_get(CACHE_USER, key, value, sizeof(value) - 1) < 0)
     {
-        printf("No username end found\n");
-        exit(1);
+        return -1;
     }
+    value[sizeof(value) - 1] = 0;
 
-    // Find the email
-    char *email = strstr(post_data_decoded, "email=");
+    char *email = strchr(value, '\n');
     if (email == NULL)
     {
-        printf("No email found\n");
-        exit(1);
+        return -1;
     }
-    email += strlen("email=");
-    char *email_end = strchr(email, '&');
+    *email++ = 0;
 
-    if (email_end == NULL)
+    if (strlen(value) >= dn_size || strlen(email) >= email_size)
     {
-        printf("No email end found\n");
-        exit(1);
+        return -1;
     }
+    strcpy(user_dn, value);
+    strcpy(ldap_email, email);
+    return 0;
+}
 
-    // Find the ldap_uri
-    char *ldap_uri = strstr(post_data_decoded, "server=");
-    if (ldap_uri == NULL)
+/// @brief Remember where a user was found, for later requests
+void remember_user(const char *ldap_uri, const char *ldap_base, const char *username, const char *user_dn,
+                   const char *ldap_email)
+{
+    char key[DIRECTORY_URI_LEN * 2];
+    char value[CACHE_VALUE_LEN];
+    user_cache_key(key, sizeof(key), ldap_uri, ldap_base, username);
+    int len = snprintf(value, sizeof(value), "%s\n%s", user_dn, ldap_email);
+    if (len > 0 && (size_t)len < sizeof(value))
     {
-        printf("No server found\n");
-        exit(1);
+        cache_put(CACHE_USER, key, value, (size_t)len + 1, cache_ttl());
     }
-    ldap_uri += strlen("server=");
-    char *server_end = strchr(ldap_uri, '+');
+}
+
+/// @brief Search the directory for a user and remember what we found
+/// @param dir An open directory
+/// @param user_dn Output buffer for the dn
+/// @param ldap_email Output buffer for the email
+/// @return LDAP_SUCCESS, or LDAP_NO_SUCH_ATTRIBUTE if the user has no email; quits on any other error
+int find_user(struct directory *dir, const char *ldap_uri, const char *ldap_base, const char *username,
+              char *user_dn, size_t dn_size, char *ldap_email, size_t email_size)
+{
+    char ldap_search_str[REQUEST_FILTER_LEN] = {
+        0,
+    };
 
-    if (server_end == NULL)
+    if (user_filter(ldap_search_str, sizeof(ldap_search_str), username) != 0)
     {
-        printf("No server end found\n");
-        exit(1);
+        printf("Username too long\n");
+        print_and_quit(1);
     }
 
-    char *ldap_base = server_end + 1;
+    ldap_email[0] = 0;
+    int status = dir_find(dir, ldap_base, ldap_search_str, "mail", ldap_email, email_size, user_dn, dn_size);
 
-    // Add the null terminators
-    *username_end = 0;
-    *email_end = 0;
-    *server_end = 0;
+    trace(TRACE_SEARCH, status);
+    if (status == LDAP_NO_SUCH_OBJECT)
+    {
+        printf("User not found\n");
+        print_and_quit(1);
+    }
+    if (status != LDAP_SUCCESS && status != LDAP_NO_SUCH_ATTRIBUTE)
+    {
+        printf("Failed to search for %s\n", ldap_search_str);
+        print_and_quit(status);
+    }
 
-    // Now, we have the username, server uri, and base dn.
-    // We need to look up the user's email address in LDAP and send them a password reset link.
+    remember_user(ldap_uri, ldap_base, username, user_dn, ldap_email);
+    return status;
+}
 
-    printf("Finding user with the following details:\n");
-    printf("username: %s\n", username);
+/// @brief Split a "<uri>+<base>" line held in domain_lines[n] into targets[n]
+/// @return 0, or -1 if the line is blank, a comment, or has no '+' between uri and base
+int add_domain(struct dir_target *targets, int n)
+{
+    char *line = domain_lines[n];
+    line[strcspn(line, "\r\n")] = 0;
 
-    // Now, we need to determine the bind dn and password for the service account.
-    char *bind_dn = malloc(strlen("cn=") + strlen(service_account_cn) + strlen(",") + strlen(ldap_base) + 1);
-    if (bind_dn == NULL)
+    char *separator = strchr(line, '+');
+    if (line[0] == 0 || line[0] == '#' || separator == NULL)
     {
-        printf("Failed to allocate memory\n");
-        exit(1);
+        return -1;
     }
-    sprintf(bind_dn, "cn=%s,%s", service_account_cn, ldap_base);
+    *separator = 0;
 
-    // The password lives in a file in the working directory called ".password.service_account"
-    FILE *password_file = fopen(".password.service_account", "r");
-    if (password_file == NULL)
+    snprintf(domain_bind_dns[n], sizeof(domain_bind_dns[n]), "cn=%s,%s", service_account_cn, separator + 1);
+    targets[n] = (struct dir_target){
+        .uri = line,
+        .base = separator + 1,
+        .bind_dn = domain_bind_dns[n],
+        .bind_pw = service_password,
+    };
+    return 0;
+}
+
+/// @brief Read the domains to look users up in when the form doesn't name one
+/// @param targets Filled in with each domain's uri, base and service account bind dn
+/// @return How many domains there are; 0 if there's no domains file
+int read_domains(struct dir_target *targets)
+{
+    FILE *domains_file = fopen(DOMAINS_FILE, "r");
+    if (domains_file == NULL)
     {
-        printf("Failed to open password file\n");
-        exit(1);
+        return 0;
     }
 
-    // Read one line from the password file
-    char bind_pw[255];
-    if (fgets(bind_pw, 255, password_file) == NULL)
+    int n = 0;
+    while (n < DIRECTORY_MAX_TARGETS && fgets(domain_lines[n], sizeof(domain_lines[n]), domains_file) != NULL)
     {
-        printf("Failed to read password\n");
-        exit(1);
+        if (add_domain(targets, n) == 0)
+        {
+            n++;
+        }
     }
+    fclose(domains_file);
+    return n;
+}
 
-    // Remove the newline from the password
-    char *newline = strchr(bind_pw, '\n');
-    if (newline != NULL)
+/// @brief Whether the mail the directory has for a user is one the email they gave ends in
+///  or contains, the way email_user() checks it
+/// @param context The email they gave
+int email_matches(void *context, const char *ldap_email)
+{
+    return ldap_email[0] != 0 && strstr(context, ldap_email) != NULL;
+}
+
+/// @brief How much one domain's answer to a fan-out says when none had the user with their
+///  email: a real failure (which may be hiding them) beats a user with another email, which
+///  beats one with no email, which beats no user at all
+int fan_out_rank(int status)
+{
+    switch (status)
     {
-        *newline = 0;
+    case LDAP_NO_SUCH_OBJECT:
+        return 0;
+    case LDAP_NO_SUCH_ATTRIBUTE:
+        return 1;
+    case LDAP_COMPARE_FALSE:
+        return 2;
+    default:
+        return 3;
     }
+}
 
-    // Initialize the LDAP connection
-    LDAP *ld;
-    ldap_initialize(&ld, ldap_uri);
+/// @brief Find which configured domain a user is in: from a recent lookup if one found them
+///  with this email, otherwise by asking every domain at once and taking the first that has
+///  them with this email. The same name may belong to different people in different domains,
+///  so one with another email doesn't settle it. Domains that don't have the user are
+///  remembered, so they aren't asked again soon.
+/// @param email The email the user gave, to check a cached lookup against
+/// @param deadline The request deadline
+/// @param ldap_uri Set to the uri of the domain the user is in
+/// @param ldap_base Set to its base dn
+/// @param searched Set to 1 if the directories had to be asked
+/// @return LDAP_SUCCESS, or LDAP_NO_SUCH_ATTRIBUTE if the user has no email; quits on any other outcome
+int find_user_anywhere(const char *username, const char *email, const struct deadline *deadline,
+                       const char **ldap_uri, const char **ldap_base, char *user_dn, size_t dn_size,
+                       char *ldap_email, size_t email_size, int *searched)
+{
+    struct dir_target domains[DIRECTORY_MAX_TARGETS];
+    int n = read_domains(domains);
 
-    // Bind to the server
-    int status = ldap_bind_s(
-        ld,
-        bind_dn,
-        bind_pw,
-        LDAP_AUTH_SIMPLE);
+    for (int i = 0; i < n; i++)
+    {
+        if (cached_user(domains[i].uri, domains[i].base, username, user_dn, dn_size, ldap_email, email_size) == 0 &&
+            email_matches((void *)email, ldap_email))
+        {
+            trace(TRACE_CACHE, 0);
+            *ldap_uri = domains[i].uri;
+            *ldap_base = domains[i].base;
+            *searched = 0;
+            trace_server(*ldap_uri);
+            return LDAP_SUCCESS;
+        }
+    }
 
-    if (status != LDAP_SUCCESS)
+    char ldap_search_str[REQUEST_FILTER_LEN] = {
+        0,
+    };
+
+    if (user_filter(ldap_search_str, sizeof(ldap_search_str), username) != 0)
     {
-        printf("Failed to bind to LDAP\n");
-        print_and_quit(status);
+        printf("Username too long\n");
+        print_and_quit(1);
     }
 
-    printf("Bind successful\n");
+    // Only ask the domains that haven't recently said they don't have this user
+    struct dir_target asked[DIRECTORY_MAX_TARGETS];
+    int n_asked = 0;
+    for (int i = 0; i < n; i++)
+    {
+        char key[DIRECTORY_URI_LEN * 2];
+        char seen;
+        user_cache_key(key, sizeof(key), domains[i].uri, domains[i].base, username);
+        if (cache_get(CACHE_MISS, key, &seen, sizeof(seen)) < 0)
+        {
+            asked[n_asked++] = domains[i];
+        }
+    }
 
-    /// Buffer for a single LDAP search result
-    unsigned char ldap_search_result_buf[sizeof(LDAPMessage *)];
-    LDAPMessage **res = (LDAPMessage **)ldap_search_result_buf;
+    if (n_asked == 0)
+    {
+        trace(TRACE_FANOUT, LDAP_NO_SUCH_OBJECT);
+        printf("User not found\n");
+        print_and_quit(1);
+    }
 
-    char ldap_search_str[255] = {
-        0,
-    };
+    *searched = 1;
+    read_service_password();
 
-    sprintf(ldap_search_str, "(SamAccountName=%s)", username);
+    // A fan-out talks to every domain, so it queues as a target of its own; the per-domain
+    //  caps don't see its searches
+    wait_for_directory("*", DOMAINS_FILE, deadline);
 
-    status = ldap_search_ext_s(
-        ld,
-        ldap_base,
-        LDAP_SCOPE_SUBTREE,
-        ldap_search_str,
-        (char *[]){"mail", NULL},
-        0,
-        NULL,
-        NULL,
-        &timeout,
-        1,
-        res);
+    ldap_email[0] = 0;
+    int winner = dir_find_first(asked, n_asked, ldap_search_str, "mail", ldap_email, email_size, user_dn, dn_size,
+                                email_matches, (void *)email, deadline);
+    sched_release();
 
-    if (status != LDAP_SUCCESS)
+    int status = winner >= 0 ? asked[winner].status : LDAP_NO_SUCH_OBJECT;
+    for (int i = 0; i < n_asked; i++)
     {
-        print_and_quit(status);
+        if (asked[i].status == LDAP_NO_SUCH_OBJECT)
+        {
+            char key[DIRECTORY_URI_LEN * 2];
+            user_cache_key(key, sizeof(key), asked[i].uri, asked[i].base, username);
+            cache_put(CACHE_MISS, key, "", 1, cache_ttl());
+        }
+        else if (asked[i].status == LDAP_INVALID_CREDENTIALS)
+        {
+            forget_service_password();
+        }
+
+        // Without a winner, report whichever domain's answer says the most
+        if (winner < 0 && fan_out_rank(asked[i].status) > fan_out_rank(status))
+        {
+            status = asked[i].status;
+        }
     }
 
-    printf("Getting email address to verify\n");
-    char *ldap_email = *ldap_get_values(ld, *res, "mail");
-    if (ldap_email == NULL)
+    trace(TRACE_FANOUT, status);
+    if (status == LDAP_NO_SUCH_OBJECT)
     {
-        printf("Email not found\n");
+        printf("User not found\n");
         print_and_quit(1);
     }
-
-    // Check to see if ldap_email is a substring of email
-    if (strstr(email, ldap_email) == NULL)
+    if (status == LDAP_COMPARE_FALSE)
     {
-        printf("Email %s does not match ldap_email %s\n", email, ldap_email);
+        printf("Email does not match\n");
         print_and_quit(1);
     }
+    if (status == LDAP_NO_SUCH_ATTRIBUTE && winner < 0)
+    {
+        return status;
+    }
+    if (winner < 0)
+    {
+        printf("Failed to search for %s\n", ldap_search_str);
+        print_and_quit(status);
+    }
 
-    printf("Email successfully verified.\n");
+    *ldap_uri = asked[winner].uri;
+    *ldap_base = asked[winner].base;
+    trace_server(*ldap_uri);
+    remember_user(*ldap_uri, *ldap_base, username, user_dn, ldap_email);
+    return status;
+}
 
-    status = ldap_unbind_s(ld);
-    // printf("unbind status: %d: %s\n", status, ldap_err2string(status));
-    if (status != LDAP_SUCCESS)
+/// @brief Forget a cached user once the directory says the cached dn is wrong
+void forget_user(const char *ldap_uri, const char *ldap_base, const char *username)
+{
+    char key[DIRECTORY_URI_LEN * 2];
+    user_cache_key(key, sizeof(key), ldap_uri, ldap_base, username);
+    cache_drop(CACHE_USER, key);
+}
+
+/// @brief Hand a message file to sendmail, giving up at the deadline
+/// @param message_filename File holding the message, headers included
+/// @param recipient Address to send it to
+/// @param deadline The request deadline
+/// @return sendmail's exit status, or -1 if it couldn't be run or didn't finish in time
+int send_mail(const char *message_filename, const char *recipient, const struct deadline *deadline)
+{
+    int message = open(message_filename, O_RDONLY);
+    if (message < 0)
     {
-        print_and_quit(status);
+        return -1;
     }
-    printf("Successfully unbound from LDAP\n");
 
-    printf("\n\n\nSending email to %s\n", email);
+    const char *sendmail = getenv("CPWD_SENDMAIL");
+    sendmail = sendmail != NULL && *sendmail != 0 ? sendmail : SENDMAIL_PATH;
 
-    // Generate a random password reset token - alphanumeric, 16 characters long
-    char token[17];
-    for (int i = 0; i < 16; i++)
+    // Run sendmail directly rather than through the shell, so the address is never parsed as shell
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // sendmail reads the message from stdin, and its chatter isn't for the user
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(message, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        execl(sendmail, "sendmail", recipient, (char *)NULL);
+        _exit(127);
+    }
+    close(message);
+    if (pid < 0)
+    {
+        return -1;
+    }
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, WNOHANG) == 0)
+    {
+        if (deadline_remaining_ms(deadline) == 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, &wstatus, 0);
+            return -1;
+        }
+
+        struct timespec poll_interval = {
+            .tv_sec = 0,
+            .tv_nsec = 2000000L,
+        };
+        nanosleep(&poll_interval, NULL);
+    }
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+}
+
+/// @brief Create a password reset link and email it to the user
+void email_user()
+{
+    // This is called as a cgi post request, so we need to read the username from the post data
+    //  and then look up the user's email address in LDAP.
+    // The post data should be supplied in stdin.
+
+    // For now, just print stdin to stdout for debugging purposes.
+
+    // Read the length of the post data from the environment.
+    char *content_length_str = getenv("CONTENT_LENGTH");
+    if (content_length_str == NULL)
+    {
+        printf("No content length\n");
+        exit(1);
+    }
+
+    // Convert the content length to an integer
+    int content_length = atoi(content_length_str);
+
+    // Allocate a buffer to read the post data into
+    char *post_data = malloc(content_length + 1);
+    if (post_data == NULL)
+    {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+
+    // Read the post data from stdin
+    int bytes_read = fread(post_data, 1, content_length, stdin);
+    if (bytes_read != content_length)
+    {
+        printf("Failed to read post data\n");
+        exit(1);
+    }
+
+    // Null-terminate the post data
+    post_data[content_length] = 0;
+    capture_body(post_data, content_length);
+
+    // Now, the post data is in the format "userid=<username>&email=<email>&server=<server_uri>+<server_basedn>"
+    //  We need to extract the username, email, and the server uri and base dn from this string.
+    //  If there's a domains file, the server may be left out (or empty) and we work out which
+    //  domain the user is in ourselves.
+    size_t username_len, email_len, server_len;
+
+    // Find the username
+    char *username = form_param(post_data, "userid", &username_len);
+    if (username == NULL)
+    {
+        printf("No username found\n");
+        exit(1);
+    }
+
+    // Find the email
+    char *email = form_param(post_data, "email", &email_len);
+    if (email == NULL)
+    {
+        printf("No email found\n");
+        exit(1);
+    }
+
+    // Find the server
+    char *server = form_param(post_data, "server", &server_len);
+    int fan_out = (server == NULL || server_len == 0) && access(DOMAINS_FILE, R_OK) == 0;
+    if (server == NULL && !fan_out)
+    {
+        printf("No server parameter found\n");
+        exit(1);
+    }
+
+    // Add the null terminators and unescape each value in place
+    username[username_len] = 0;
+    email[email_len] = 0;
+    percent_decode(username, username, username_len);
+    percent_decode(email, email, email_len);
+
+    // We need to save the encoded server parameter to use it later; a fan-out fills it in
+    //  once it knows the domain.
+    char *server_param = NULL;
+    const char *ldap_uri = "*";
+    const char *ldap_base = DOMAINS_FILE;
+    if (!fan_out)
+    {
+        server_param = strndup(server, server_len);
+        if (server_param == NULL)
+        {
+            printf("Failed to allocate memory\n");
+            exit(1);
+        }
+
+        server[server_len] = 0;
+        percent_decode(server, server, server_len);
+
+        char *server_end = strchr(server, '+');
+        if (server_end == NULL)
+        {
+            printf("No server end found\n");
+            exit(1);
+        }
+        *server_end = 0;
+
+        ldap_uri = server;
+        ldap_base = server_end + 1;
+    }
+
+    // The address is sendmail's first argument, where a leading '-' would be parsed as an option
+    if (email[0] == '-')
+    {
+        printf("Invalid email\n");
+        exit(1);
+    }
+
+    // Now, we have the username, server uri, and base dn.
+    // We need to look up the user's email address in LDAP and send them a password reset link.
+    trace_server(ldap_uri);
+    trace(TRACE_PARSED, 0);
+
+    // Everything from here on shares one time budget
+    struct deadline deadline;
+    deadline_start_request(&deadline);
+
+    // If the same reset is already running, or was just done, share it rather than
+    //  searching again and mailing out a second token. Fan-outs share under "*+.domains".
+    char flight_key[DIRECTORY_URI_LEN * 2];
+    user_cache_key(flight_key, sizeof(flight_key), ldap_uri, ldap_base, username);
+
+    char token[TOKEN_LEN + 1];
+    enum flight_role role = flight_begin(flight_key, email, deadline_remaining_ms(&deadline), token);
+    trace(TRACE_COALESCE, role);
+    if (role == FLIGHT_BUSY)
+    {
+        printf("A reset for this user is already in progress, please check your email in a minute\n");
+        print_and_quit(LDAP_BUSY);
+    }
+    if (role == FLIGHT_JOINED || role == FLIGHT_REUSED)
+    {
+        printf("A reset link was just sent to %s, please check your email\n", email);
+        capture_result(0);
+        trace(TRACE_DONE, 0);
+        return;
+    }
+
+    // A user we found recently doesn't need another trip to the directory, as long as the
+    //  email still matches; if it doesn't, ask the directory in case it has changed.
+    char ldap_email[REQUEST_EMAIL_LEN];
+    char user_dn[DIRECTORY_DN_LEN];
+    int searched = 0;
+    if (fan_out)
+    {
+        int status = find_user_anywhere(username, email, &deadline, &ldap_uri, &ldap_base, user_dn, sizeof(user_dn),
+                                        ldap_email, sizeof(ldap_email), &searched);
+        if (status == LDAP_NO_SUCH_ATTRIBUTE)
+        {
+            printf("Email not found\n");
+            print_and_quit(1);
+        }
+
+        // The reset link has to name the domain we found the user in
+        char encoded_uri[DIRECTORY_URI_LEN * 3];
+        char encoded_base[DIRECTORY_URI_LEN * 3];
+        server_param = malloc(sizeof(encoded_uri) + sizeof(encoded_base));
+        if (server_param == NULL)
+        {
+            printf("Failed to allocate memory\n");
+            exit(1);
+        }
+        if (percent_encode(encoded_uri, sizeof(encoded_uri), ldap_uri) != 0 ||
+            percent_encode(encoded_base, sizeof(encoded_base), ldap_base) != 0)
+        {
+            printf("Server too long\n");
+            print_and_quit(1);
+        }
+        sprintf(server_param, "%s+%s", encoded_uri, encoded_base);
+    }
+    else if (cached_user(ldap_uri, ldap_base, username, user_dn, sizeof(user_dn), ldap_email, sizeof(ldap_email)) == 0 &&
+        ldap_email[0] != 0 && strstr(email, ldap_email) != NULL)
+    {
+        trace(TRACE_CACHE, 0);
+    }
+    else
     {
-        token[i] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"[rand() % 62];
+        searched = 1;
+        wait_for_directory(ldap_uri, ldap_base, &deadline);
+
+        struct directory dir;
+        open_directory(&dir, ldap_uri, ldap_base, &deadline);
+
+        int status = find_user(&dir, ldap_uri, ldap_base, username, user_dn, sizeof(user_dn), ldap_email,
+                               sizeof(ldap_email));
+        if (status == LDAP_NO_SUCH_ATTRIBUTE)
+        {
+            printf("Email not found\n");
+            print_and_quit(1);
+        }
+
+        status = dir_close(&dir);
+        trace(TRACE_UNBIND, status);
+        sched_release();
+        if (status != LDAP_SUCCESS)
+        {
+            print_and_quit(status);
+        }
+    }
+
+    // Check to see if ldap_email is a substring of email
+    if (strstr(email, ldap_email) == NULL)
+    {
+        printf("Email does not match\n");
+        print_and_quit(1);
     }
-    token[16] = 0;
+
+    trace(TRACE_VERIFY, 0);
+
+    printf("Sending email to %s\n", email);
+
+    // Generate a random password reset token - alphanumeric, 16 characters long
+    generate_token(token);
 
     // Get our FQDN to build the URL
     char fqdn[255];
@@ -292,7 +756,7 @@ void email_user()
     sprintf(reset_link, "http://%s/cgi-bin/set-password?token=%s&username=%s&server=%s", fqdn, token, username, server_param);
 
     // Now, we need to send an email to the user with a password reset link.
-    // We'll do this by calling to the shell to run the sendmail command.
+    // We'll do this by running the sendmail command.
 
     // Create a temporary file called ".%s", where %s is the username
     char email_filename[255];
@@ -314,29 +778,27 @@ void email_user()
 
     fclose(email_file);
 
-    // Now, we need to send the email. Do this by calling the sendmail command.
-    // Use popen to run the sendmail command and write the email contents to it,
-    // and write its stdout to our stdout.
-    char sendmail_command[667];
-    sprintf(sendmail_command, "/usr/sbin/sendmail < %s %s", email_filename, email);
+    // Now, we need to send the email. Do this by running the sendmail command with the
+    //  email contents file as its input, within what's left of the time budget.
+    require_budget(&deadline);
+    fflush(stdout);
+    int status = send_mail(email_filename, email, &deadline);
 
-    FILE *sendmail_output = popen(sendmail_command, "r");
-    if (sendmail_output == NULL)
+    trace(TRACE_MAIL, status);
+    if (status == -1)
     {
         printf("Failed to run sendmail\n");
         print_and_quit(1);
     }
-
-    printf("<debug output<\n");
-    // Read the output of the sendmail command and write it to stdout
-    char sendmail_output_buf[255];
-    while (fgets(sendmail_output_buf, 255, sendmail_output) != NULL)
+    if (status != 0)
     {
-        printf("%s", sendmail_output_buf);
+        // Not flight_end(): duplicates shouldn't be told a reset went out when it didn't
+        printf("Failed to send email, sendmail exited with %d\n", status);
+        print_and_quit(1);
     }
-    pclose(sendmail_output);
-
-    printf(">done>\n");
+    flight_end(token, searched);
+    capture_result(0);
+    trace(TRACE_DONE, 0);
 }
 
 /// @brief Set the password for a user via LDAP
@@ -351,74 +813,46 @@ void set_password()
         print_and_quit(1);
     }
 
+    size_t token_len, username_len, server_len;
+
     // Find the token
-    char *token = strstr(query_string, "token=");
+    char *token = form_param(query_string, "token", &token_len);
     if (token == NULL)
     {
         printf("No token found\n");
         print_and_quit(1);
     }
-    token += strlen("token=");
-    char *token_end = strchr(token, '&');
-
-    if (token_end == NULL)
-    {
-        printf("No token end found\n");
-        print_and_quit(1);
-    }
 
     // Find the username
-    char *username = strstr(query_string, "username=");
+    char *username = form_param(query_string, "username", &username_len);
     if (username == NULL)
     {
         printf("No username found\n");
         print_and_quit(1);
     }
-    username += strlen("username=");
-    char *username_end = strchr(username, '&');
-
-    if (username_end == NULL)
-    {
-        printf("No username end found\n");
-        print_and_quit(1);
-    }
 
     // Find the server
-    char *server = strstr(query_string, "server=");
+    char *server = form_param(query_string, "server", &server_len);
     if (server == NULL)
     {
         printf("No server found\n");
         print_and_quit(1);
     }
-    server += strlen("server=");
 
-    // Add the null terminator for the username and token
-    *username_end = 0;
-    *token_end = 0;
+    // Add the null terminators
+    token[token_len] = 0;
+    username[username_len] = 0;
+    server[server_len] = 0;
 
     // Now, we have the username and token.
+    trace(TRACE_PARSED, 0);
 
     // For server, we need to urldecode it just like we did for the post data in email_user()
-    CURL *curl = curl_easy_init();
-    if (curl == NULL)
-    {
-        printf("Failed to initialize curl\n");
-        print_and_quit(1);
-    }
-
-    int server_len = strlen(server);
-    char *server_decoded = curl_easy_unescape(curl, server, server_len, &server_len);
-    if (server_decoded == NULL)
-    {
-        printf("Failed to decode server\n");
-        print_and_quit(1);
-    }
-
-    // Now, we have the decoded server string.
+    percent_decode(server, server, server_len);
 
     // We need to extract the server uri and base dn from this string.
-    char *ldap_uri = server_decoded;
-    char *ldap_uri_end = strchr(server_decoded, '+');
+    char *ldap_uri = server;
+    char *ldap_uri_end = strchr(server, '+');
     if (ldap_uri_end == NULL)
     {
         printf("No server uri end found\n");
@@ -429,6 +863,7 @@ void set_password()
 
     // Add the null terminator for the server uri
     *ldap_uri_end = 0;
+    trace_server(ldap_uri);
 
     // First, check to see if there's a file called ".%s" in the working directory, where %s is the username.
     // If there is, read the contents of the file and see if the token string is located anywhere in the file.
@@ -461,114 +896,42 @@ void set_password()
     email_contents[email_contents_len] = 0;
 
     // Check to see if the token is in the email contents
-    if (strlen(token) != 16 || strstr(email_contents, token) == NULL)
+    if (!token_verify(token, email_contents))
     {
         printf("Invalid token or not in your email\n");
         print_and_quit(1);
     }
 
-    // Now, look up the DN for the user and set their password.
-    // TODO: For now, this is hardcoded for AD.
+    trace(TRACE_TOKEN, 0);
 
-    // Now, we need to determine the bind dn and password for the service account.
-    char *bind_dn = malloc(strlen("cn=") + strlen(service_account_cn) + strlen(",") + strlen(ldap_base) + 1);
-    if (bind_dn == NULL)
-    {
-        printf("Failed to allocate memory\n");
-        exit(1);
-    }
-    sprintf(bind_dn, "cn=%s,%s", service_account_cn, ldap_base);
+    // Everything from here on shares one time budget
+    struct deadline deadline;
+    deadline_start_request(&deadline);
 
-    // The password lives in a file in the working directory called ".password.service_account"
-    FILE *password_file = fopen(".password.service_account", "r");
-    if (password_file == NULL)
-    {
-        printf("Failed to open password file\n");
-        exit(1);
-    }
-
-    // Read one line from the password file
-    char bind_pw[255];
-    if (fgets(bind_pw, 255, password_file) == NULL)
-    {
-        printf("Failed to read password\n");
-        exit(1);
-    }
-
-    // Remove the newline from the password
-    char *newline = strchr(bind_pw, '\n');
-    if (newline != NULL)
-    {
-        *newline = 0;
-    }
-
-    // Initialize the LDAP connection
-    LDAP *ld;
-    ldap_initialize(&ld, ldap_uri);
-
-    // Bind to the server
-    int status = ldap_bind_s(
-        ld,
-        bind_dn,
-        bind_pw,
-        LDAP_AUTH_SIMPLE);
-
-    if (status != LDAP_SUCCESS)
-    {
-        printf("Failed to bind to LDAP\n");
-        print_and_quit(status);
-    }
-
-    /// Buffer for a single LDAP search result
-    unsigned char ldap_search_result_buf[sizeof(LDAPMessage *)];
-    LDAPMessage **res = (LDAPMessage **)ldap_search_result_buf;
-
-    char ldap_search_str[255] = {
-        0,
-    };
+    wait_for_directory(ldap_uri, ldap_base, &deadline);
 
-    sprintf(ldap_search_str, "(SamAccountName=%s)", username);
+    // Now, look up the DN for the user and set their password.
+    // TODO: For now, this is hardcoded for AD.
+    struct directory dir;
+    open_directory(&dir, ldap_uri, ldap_base, &deadline);
 
     // We're going to create a new password, with 16 random alphanumeric characters,
     //  followed by Aa1! to cheese the password policy.
-    // That length is going to be 16 (random) + 4 (fixed) + 1 (null terminator) = 21
-    char *newpasswd = malloc(21);
+    char newpasswd[PASSWORD_LEN + 1];
+    generate_password(newpasswd);
 
-    for (int i = 0; i < 16; i++)
+    // The email-user request that sent the token will usually have cached the dn
+    char user_dn[DIRECTORY_DN_LEN];
+    char ldap_email[REQUEST_EMAIL_LEN];
+    int cached = cached_user(ldap_uri, ldap_base, username, user_dn, sizeof(user_dn), ldap_email,
+                             sizeof(ldap_email)) == 0;
+    if (cached)
     {
-        newpasswd[i] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"[rand() % 62];
-    }
-
-    newpasswd[16] = 'A';
-    newpasswd[17] = 'a';
-    newpasswd[18] = '1';
-    newpasswd[19] = '!';
-    newpasswd[20] = 0;
-
-    status = ldap_search_ext_s(
-        ld,
-        ldap_base,
-        LDAP_SCOPE_SUBTREE,
-        ldap_search_str,
-        (char *[]){"distinguishedName", NULL},
-        0,
-        NULL,
-        NULL,
-        &timeout,
-        1,
-        res);
-
-    if (status != LDAP_SUCCESS)
-    {
-        printf("Failed to search for %s\n", ldap_search_str);
-        print_and_quit(status);
+        trace(TRACE_CACHE, 0);
     }
-
-    char *user_dn = *ldap_get_values(ld, *res, "distinguishedName");
-    if (user_dn == NULL)
+    else
     {
-        printf("User not found\n");
-        print_and_quit(1);
+        find_user(&dir, ldap_uri, ldap_base, username, user_dn, sizeof(user_dn), ldap_email, sizeof(ldap_email));
     }
 
     // This is AD:
@@ -578,24 +941,11 @@ void set_password()
     // 2. Convert the password to UTF-16LE (No BOM)
     // 3. Send the password as a binary value in an LDAP modify operation
 
-    // So, first, add the quotes.
-    char *newpasswd_quoted = malloc(strlen(newpasswd) + 3); // 2 characters for the quotes, 1 for the null terminator
-    newpasswd_quoted[0] = '"';
-    strcpy(newpasswd_quoted + 1, newpasswd);
-    newpasswd_quoted[strlen(newpasswd) + 1] = '"';
-    newpasswd_quoted[strlen(newpasswd) + 2] = 0;
-
-    // Then, convert the quoted password to UTF-16LE (No BOM)
-    uint8_t *newpasswd_utf16le = malloc(strlen(newpasswd_quoted) * 2); // 2 bytes per character, no null terminator or BOM
-
-    for (int i = 0; i < (int)strlen(newpasswd_quoted); i++)
-    {
-        newpasswd_utf16le[i * 2] = newpasswd_quoted[i];
-        newpasswd_utf16le[i * 2 + 1] = 0;
-    }
+    // unicode_pwd_encode() does the first two.
+    uint8_t newpasswd_utf16le[UNICODE_PWD_SIZE(PASSWORD_LEN)];
 
     struct berval passwd_berval = {
-        .bv_len = strlen(newpasswd_quoted) * 2,
+        .bv_len = unicode_pwd_encode(newpasswd_utf16le, newpasswd),
         .bv_val = (char *)newpasswd_utf16le,
     };
 
@@ -608,13 +958,18 @@ void set_password()
 
     LDAPMod *mods[] = {&mod, NULL};
 
-    status = ldap_modify_ext_s(
-        ld,
-        user_dn,
-        mods,
-        NULL,
-        NULL);
+    int status = dir_modify(&dir, user_dn, mods);
+    if (status == LDAP_NO_SUCH_OBJECT && cached)
+    {
+        // The user was moved or renamed since we cached their dn
+        forget_user(ldap_uri, ldap_base, username);
+        find_user(&dir, ldap_uri, ldap_base, username, user_dn, sizeof(user_dn), ldap_email, sizeof(ldap_email));
+        status = dir_modify(&dir, user_dn, mods);
+    }
 
+    trace(TRACE_MODIFY, status);
+    dir_close(&dir);
+    sched_release();
     if (status != LDAP_SUCCESS)
     {
         printf("user modify failed, status: %d: %s\n", status, ldap_err2string(status));
@@ -630,6 +985,17 @@ void set_password()
         printf("Failed to delete email contents file %s\n", email_filename);
         print_and_quit(1);
     }
+
+    // The token is spent, so a new reset request must mail a new one, whether or not the
+    //  request that sent it named the domain
+    char flight_key[DIRECTORY_URI_LEN * 2];
+    user_cache_key(flight_key, sizeof(flight_key), ldap_uri, ldap_base, username);
+    flight_forget(flight_key);
+    user_cache_key(flight_key, sizeof(flight_key), "*", DOMAINS_FILE, username);
+    flight_forget(flight_key);
+
+    capture_result(0);
+    trace(TRACE_DONE, 0);
 }
 
 void debug()
@@ -654,20 +1020,17 @@ void debug()
         exit(1);
     }
 
+    struct deadline deadline;
+
     //////////////////////////////////////////////////////////////
     ////// debug for email-user
 
     printf("Connecting to LDAP as %s\n", bind_dn);
-    // Initialize the LDAP connection
-    LDAP *ld;
-    ldap_initialize(&ld, ldap_uri);
+    deadline_start_request(&deadline);
 
-    // Bind to the server
-    int status = ldap_bind_s(
-        ld,
-        bind_dn,
-        bind_pw,
-        LDAP_AUTH_SIMPLE);
+    // Connect and bind to the server
+    struct directory dir;
+    int status = dir_open(&dir, ldap_uri, ldap_base, bind_dn, bind_pw, &deadline);
 
     if (status != LDAP_SUCCESS)
     {
@@ -677,43 +1040,30 @@ void debug()
 
     printf("Bind successful\n");
 
-    /// Buffer for a single LDAP search result
-    unsigned char ldap_search_result_buf[sizeof(LDAPMessage *)];
-    LDAPMessage **res = (LDAPMessage **)ldap_search_result_buf;
-
-    char ldap_search_str[255] = {
+    char ldap_search_str[REQUEST_FILTER_LEN] = {
         0,
     };
 
-    sprintf(ldap_search_str, "(SamAccountName=%s)", username);
+    if (user_filter(ldap_search_str, sizeof(ldap_search_str), username) != 0)
+    {
+        printf("Username too long\n");
+        print_and_quit(1);
+    }
 
-    status = ldap_search_ext_s(
-        ld,
-        ldap_base,
-        LDAP_SCOPE_SUBTREE,
-        ldap_search_str,
-        (char *[]){"mail", NULL},
-        0,
-        NULL,
-        NULL,
-        &timeout,
-        1,
-        res);
+    char ldap_email[REQUEST_EMAIL_LEN];
+    status = dir_find(&dir, ldap_base, ldap_search_str, "mail", ldap_email, sizeof(ldap_email), NULL, 0);
 
     printf("search status: %d: %s\n", status, ldap_err2string(status));
 
-    if (status != LDAP_SUCCESS)
-    {
-        print_and_quit(status);
-    }
-
-    printf("Getting email address to verify\n");
-    char *ldap_email = *ldap_get_values(ld, *res, "mail");
-    if (ldap_email == NULL)
+    if (status == LDAP_NO_SUCH_ATTRIBUTE)
     {
         printf("Email not found\n");
         print_and_quit(1);
     }
+    if (status != LDAP_SUCCESS)
+    {
+        print_and_quit(status);
+    }
 
     // Use strstr to check if email is a substring of ldap_email
     if (strstr(email, ldap_email) == NULL)
@@ -723,7 +1073,7 @@ void debug()
     }
     printf("Email successfully verified.\n");
 
-    status = ldap_unbind_s(ld);
+    status = dir_close(&dir);
     // printf("unbind status: %d: %s\n", status, ldap_err2string(status));
     if (status != LDAP_SUCCESS)
     {
@@ -736,15 +1086,10 @@ void debug()
     ////// debug for set-password
 
     printf("Connecting to LDAP as %s\n", bind_dn);
-    // Initialize the LDAP connection
-    ldap_initialize(&ld, ldap_uri);
+    deadline_start_request(&deadline);
 
-    // Bind to the server
-    status = ldap_bind_s(
-        ld,
-        bind_dn,
-        bind_pw,
-        LDAP_AUTH_SIMPLE);
+    // Connect and bind to the server
+    status = dir_open(&dir, ldap_uri, ldap_base, bind_dn, bind_pw, &deadline);
 
     if (status != LDAP_SUCCESS)
     {
@@ -754,35 +1099,26 @@ void debug()
 
     printf("Bind successful\n");
 
-    sprintf(ldap_search_str, "(SamAccountName=%s)", username);
+    if (user_filter(ldap_search_str, sizeof(ldap_search_str), username) != 0)
+    {
+        printf("Username too long\n");
+        print_and_quit(1);
+    }
 
-    status = ldap_search_ext_s(
-        ld,
-        ldap_base,
-        LDAP_SCOPE_SUBTREE,
-        ldap_search_str,
-        (char *[]){"distinguishedName", NULL},
-        0,
-        NULL,
-        NULL,
-        &timeout,
-        1,
-        res);
+    char user_dn[DIRECTORY_DN_LEN];
+    status = dir_find(&dir, ldap_base, ldap_search_str, "distinguishedName", user_dn, sizeof(user_dn), NULL, 0);
 
     printf("search status: %d: %s\n", status, ldap_err2string(status));
 
-    if (status != LDAP_SUCCESS)
-    {
-        print_and_quit(status);
-    }
-
-    printf("Getting distinguished name\n");
-    char *user_dn = *ldap_get_values(ld, *res, "distinguishedName");
-    if (user_dn == NULL)
+    if (status == LDAP_NO_SUCH_OBJECT || status == LDAP_NO_SUCH_ATTRIBUTE)
     {
         printf("User not found\n");
         print_and_quit(1);
     }
+    if (status != LDAP_SUCCESS)
+    {
+        print_and_quit(status);
+    }
     printf("user_dn: %s\n", user_dn);
 
     // This is AD:
@@ -792,24 +1128,16 @@ void debug()
     // 2. Convert the password to UTF-16LE (No BOM)
     // 3. Send the password as a binary value in an LDAP modify operation
 
-    // So, first, add the quotes.
-    char *newpasswd_quoted = malloc(strlen(newpasswd) + 3); // 2 characters for the quotes, 1 for the null terminator
-    newpasswd_quoted[0] = '"';
-    strcpy(newpasswd_quoted + 1, newpasswd);
-    newpasswd_quoted[strlen(newpasswd) + 1] = '"';
-    newpasswd_quoted[strlen(newpasswd) + 2] = 0;
-
-    // Then, convert the quoted password to UTF-16LE (No BOM)
-    uint8_t *newpasswd_utf16le = malloc(strlen(newpasswd_quoted) * 2); // 2 bytes per character, no null terminator or BOM
-
-    for (int i = 0; i < (int)strlen(newpasswd_quoted); i++)
+    // unicode_pwd_encode() does the first two.
+    uint8_t *newpasswd_utf16le = malloc(UNICODE_PWD_SIZE(strlen(newpasswd)));
+    if (newpasswd_utf16le == NULL)
     {
-        newpasswd_utf16le[i * 2] = newpasswd_quoted[i];
-        newpasswd_utf16le[i * 2 + 1] = 0;
+        printf("Failed to allocate memory\n");
+        exit(1);
     }
 
     struct berval passwd_berval = {
-        .bv_len = strlen(newpasswd_quoted) * 2,
+        .bv_len = unicode_pwd_encode(newpasswd_utf16le, newpasswd),
         .bv_val = (char *)newpasswd_utf16le,
     };
 
@@ -822,12 +1150,8 @@ void debug()
 
     LDAPMod *mods[] = {&mod, NULL};
 
-    status = ldap_modify_ext_s(
-        ld,
-        user_dn,
-        mods,
-        NULL,
-        NULL);
+    status = dir_modify(&dir, user_dn, mods);
+    dir_close(&dir);
 
     printf("modify status: %d: %s\n", status, ldap_err2string(status));
     if (status != LDAP_SUCCESS)
@@ -838,8 +1162,57 @@ void debug()
     printf("Password successfully changed.\n");
 }
 
+/// @brief Check every user of the domains named on the command line, or of the domains file,
+///  for problems that would stop a reset, and write a report to stdout
+/// @param argc Number of domains given
+/// @param argv The domains, each "<uri>+<base>"
+void audit(int argc, char **argv)
+{
+    struct dir_target domains[DIRECTORY_MAX_TARGETS];
+    int n = 0;
+
+    if (argc > DIRECTORY_MAX_TARGETS)
+    {
+        printf("Too many domains, at most %d at once\n", DIRECTORY_MAX_TARGETS);
+        exit(1);
+    }
+    for (int i = 0; i < argc; i++)
+    {
+        snprintf(domain_lines[n], sizeof(domain_lines[n]), "%s", argv[i]);
+        if (add_domain(domains, n) != 0)
+        {
+            printf("Expected <uri>+<base>, not %s\n", argv[i]);
+            exit(1);
+        }
+        n++;
+    }
+    if (argc == 0)
+    {
+        n = read_domains(domains);
+    }
+    if (n == 0)
+    {
+        printf("No domains to audit\n");
+        exit(1);
+    }
+
+    read_service_password();
+
+    // The report is read as it's written
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    exit(audit_domains(domains, n, stdout));
+}
+
 int main(int argc, char **argv)
 {
+    // `crappasswd audit` is run by hand rather than by the web server, so it has no header.
+    //  A server passes an ISINDEX-style query as argv, so `crappasswd?audit` would look the
+    //  same; under CGI it falls through to the argument check below instead.
+    if (argc >= 2 && strstr(argv[0], "crappasswd") != NULL && strcmp(argv[1], "audit") == 0 &&
+        getenv("GATEWAY_INTERFACE") == NULL)
+    {
+        audit(argc - 2, argv + 2);
+    }
 
     printf("Content-Type: text/plain;charset=us-ascii\n\n");
 
@@ -849,6 +1222,7 @@ int main(int argc, char **argv)
     // If the binary is called as `set-password`, it will generate a new password for the user,
     //  set it via LDAP, and display the new password to the user.
     // If the binary is called as anything else, it will print an error message and exit???
+    //  (`crappasswd audit`, handled above, is the exception that takes arguments.)
 
     if (argc != 1)
     {
@@ -859,13 +1233,18 @@ int main(int argc, char **argv)
     // TODO: Is there a race condition here? Same seed for all runs that happen within a second of each other.
     srand(time(NULL));
 
+    trace_open();
+    trace(TRACE_START, 0);
+
     // Check to see if the binary was called as a command that ends with "email-user" or "set-password"
     if (strstr(argv[0], "email-user") != NULL)
     {
+        capture_begin(CAPTURE_EMAIL_USER);
         email_user();
     }
     else if (strstr(argv[0], "set-password") != NULL)
     {
+        capture_begin(CAPTURE_SET_PASSWORD);
         set_password();
     }
     else if (strstr(argv[0], "crappasswd") != NULL)
@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "plan.h"
+
+static struct plan_segment *seg;
+
+/// Set once attaching has failed, so we don't retry on every lookup
+static int unavailable;
+
+static const char *strategy_names[PLAN_STRATEGY_COUNT] = {
+    [PLAN_ONE_LEVEL] = "one-level",
+    [PLAN_NARROW_SUBTREE] = "narrow-subtree",
+    [PLAN_FULL_SUBTREE] = "full-subtree",
+};
+
+static uint64_t now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec;
+}
+
+static void plan_init(void *segment)
+{
+    struct plan_segment *s = segment;
+
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&s->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+}
+
+static int attach(void)
+{
+    if (seg == NULL && !unavailable)
+    {
+        seg = shm_attach(PLAN_SHM_NAME, sizeof(struct plan_segment), PLAN_MAGIC, plan_init);
+        unavailable = seg == NULL;
+    }
+    return seg == NULL ? -1 : 0;
+}
+
+static int lock(void)
+{
+    int status = pthread_mutex_lock(&seg->lock);
+    if (status == EOWNERDEAD)
+    {
+        // Only counters and container names live here; a torn update is harmless
+        pthread_mutex_consistent(&seg->lock);
+        status = 0;
+    }
+    return status;
+}
+
+/// @brief The parent of a dn: everything after the first unescaped ',', or NULL at the root
+static const char *dn_parent(const char *dn)
+{
+    for (const char *p = dn; *p != 0; p++)
+    {
+        if (*p == '\\' && p[1] != 0)
+        {
+            p++;
+        }
+        else if (*p == ',')
+        {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Whether dn is ancestor itself or lies somewhere under it
+static int dn_within(const char *dn, const char *ancestor)
+{
+    size_t len = strlen(dn);
+    size_t ancestor_len = strlen(ancestor);
+    if (ancestor_len > len || strcasecmp(dn + len - ancestor_len, ancestor) != 0)
+    {
+        return 0;
+    }
+    return ancestor_len == len || dn[len - ancestor_len - 1] == ',';
+}
+
+/// @brief Find the entry for a target, claiming (or recycling) one if asked to
+static struct plan_target *find_target(const char *name, int claim)
+{
+    uint64_t key = shm_key(name);
+    struct plan_target *oldest = NULL;
+
+    for (int i = 0; i < PLAN_TARGETS; i++)
+    {
+        struct plan_target *target = &seg->targets[(key + i) % PLAN_TARGETS];
+        if (target->key == key)
+        {
+            return target;
+        }
+        if (target->key == 0)
+        {
+            oldest = target;
+            break;
+        }
+        if (oldest == NULL || target->last_used_s < oldest->last_used_s)
+        {
+            oldest = target;
+        }
+    }
+
+    if (!claim || oldest == NULL)
+    {
+        return NULL;
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->key = key;
+    strncpy(oldest->name, name, PLAN_NAME_LEN - 1);
+    return oldest;
+}
+
+/// @brief Whether a step has been finding users often enough to be worth its round trip
+static int worth_trying(struct plan_stats *stats)
+{
+    if (stats->tries < PLAN_MIN_SAMPLES || stats->hits * 100 >= stats->tries * PLAN_MIN_HIT_PCT)
+    {
+        return 1;
+    }
+    return stats->skipped++ % PLAN_PROBE_EVERY == 0;
+}
+
+int plan_search(const char *target, const char *base, struct plan_step *steps)
+{
+    int n = 0;
+
+    if (attach() == 0 && lock() == 0)
+    {
+        struct plan_target *t = find_target(target, 0);
+        const struct plan_container *busiest = NULL;
+        char shared[PLAN_DN_LEN] = "";
+
+        for (int c = 0; t != NULL && c < PLAN_CONTAINERS; c++)
+        {
+            const struct plan_container *container = &t->containers[c];
+            if (container->hits == 0 || !dn_within(container->dn, base))
+            {
+                continue;
+            }
+            if (busiest == NULL || container->hits > busiest->hits)
+            {
+                busiest = container;
+            }
+
+            // Walk the shared container up until this one lies under it too
+            if (shared[0] == 0)
+            {
+                snprintf(shared, sizeof(shared), "%s", container->dn);
+            }
+            while (!dn_within(container->dn, shared))
+            {
+                // Stops at base at the latest, since every container is under it
+                const char *parent = dn_parent(shared);
+                if (parent == NULL)
+                {
+                    break;
+                }
+                memmove(shared, parent, strlen(parent) + 1);
+            }
+        }
+
+        if (busiest != NULL && worth_trying(&t->stats[PLAN_ONE_LEVEL]))
+        {
+            steps[n].strategy = PLAN_ONE_LEVEL;
+            snprintf(steps[n].base, sizeof(steps[n].base), "%s", busiest->dn);
+            n++;
+        }
+
+        // Only worth it if it's actually narrower than the whole base
+        if (strlen(shared) > strlen(base) && worth_trying(&t->stats[PLAN_NARROW_SUBTREE]))
+        {
+            steps[n].strategy = PLAN_NARROW_SUBTREE;
+            snprintf(steps[n].base, sizeof(steps[n].base), "%s", shared);
+            n++;
+        }
+
+        pthread_mutex_unlock(&seg->lock);
+    }
+
+    steps[n].strategy = PLAN_FULL_SUBTREE;
+    snprintf(steps[n].base, sizeof(steps[n].base), "%s", base);
+    return n + 1;
+}
+
+/// @brief Count a hit on the container holding dn, remembering it if it's new
+static void learn(struct plan_target *t, const char *base, const char *dn)
+{
+    const char *container = dn_parent(dn);
+    if (container == NULL || !dn_within(container, base) || strlen(container) >= PLAN_DN_LEN)
+    {
+        return;
+    }
+
+    struct plan_container *slot = NULL;
+    for (int c = 0; c < PLAN_CONTAINERS; c++)
+    {
+        struct plan_container *candidate = &t->containers[c];
+        if (candidate->hits > 0 && strcasecmp(candidate->dn, container) == 0)
+        {
+            slot = candidate;
+            break;
+        }
+        if (slot == NULL || candidate->hits < slot->hits)
+        {
+            slot = candidate;
+        }
+    }
+
+    if (strcasecmp(slot->dn, container) != 0 || slot->hits == 0)
+    {
+        // Replacing the least used container
+        snprintf(slot->dn, sizeof(slot->dn), "%s", container);
+        slot->hits = 0;
+    }
+
+    if (++slot->hits >= PLAN_DECAY_AT)
+    {
+        for (int c = 0; c < PLAN_CONTAINERS; c++)
+        {
+            t->containers[c].hits /= 2;
+        }
+    }
+}
+
+void plan_record(const char *target, const char *base, enum plan_strategy strategy, const char *found_dn,
+                 uint32_t ms)
+{
+    if (attach() != 0 || lock() != 0)
+    {
+        return;
+    }
+
+    struct plan_target *t = find_target(target, 1);
+    if (t != NULL)
+    {
+        t->last_used_s = now_s();
+
+        struct plan_stats *stats = &t->stats[strategy];
+        stats->tries++;
+        stats->hits += found_dn != NULL;
+        stats->total_ms += ms;
+        if (stats->tries >= PLAN_DECAY_AT)
+        {
+            stats->tries /= 2;
+            stats->hits /= 2;
+            stats->total_ms /= 2;
+        }
+
+        if (found_dn != NULL)
+        {
+            learn(t, base, found_dn);
+        }
+    }
+
+    pthread_mutex_unlock(&seg->lock);
+}
+
+const char *plan_strategy_name(enum plan_strategy strategy)
+{
+    return strategy < PLAN_STRATEGY_COUNT ? strategy_names[strategy] : "?";
+}
@@ -0,0 +1,624 @@
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "request.h"
+
+// crappasswd_replay: play a capture log (see capture.h) back against a stand-in directory,
+//  keeping the captured arrival pattern but compressed by the given speed-up, and report
+//  the latency and outcome distributions.
+//
+// Usage: crappasswd_replay -d <uri> [-s <speed>] [-b <cgi dir>] [-p <password>] [-j <max jobs>] <log>
+//
+//  -d  The stand-in directory: every request's server parameter is pointed at this uri,
+//      keeping the base dn. Required, so a replay never reaches the captured servers.
+//  -s  1, 10, 100, ...: how much faster than captured to send requests (default 1)
+//  -b  A scratch directory holding the email-user and set-password links; requests run
+//      there (default .)
+//  -p  The stand-in's service account password (default REPLAY_PASSWORD)
+//  -j  Most requests in flight at once (default 256); later ones are sent late instead
+//
+// Captured tokens are redacted, so before each set-password the replayer writes the
+//  redacted token to .<username> in the cgi directory, the way email-user would have. A
+//  replay run in a live cgi directory would do that to real users, so the replayer refuses
+//  a cgi directory holding any dot file: tokens, the service account's password or a
+//  domains file. It writes the stand-in's password file there itself, and removes it at
+//  the end. Replayed requests use their own shared memory segments (CPWD_SHM_PREFIX), and
+//  mail goes to REPLAY_SENDMAIL (through CPWD_SENDMAIL), never to sendmail.
+
+#define REPLAY_DEFAULT_JOBS 256
+
+/// What replayed requests run instead of sendmail
+#define REPLAY_SENDMAIL "/bin/true"
+
+/// CPWD_SHM_PREFIX for replayed requests, unless one is set already
+#define REPLAY_SHM_PREFIX "replay"
+
+/// Default service account password for the stand-in directory
+#define REPLAY_PASSWORD "replay"
+
+/// The password file the cgi programs read, relative to the cgi directory
+#define REPLAY_PASSWORD_FILE ".password.service_account"
+
+/// Output kept per request, enough for the FAIL! line
+#define REPLAY_OUTPUT_LEN 4096
+
+/// Latency histogram buckets; bucket i counts requests that took under 2^i ms
+#define REPLAY_HIST_BUCKETS 18
+
+#define REPLAY_MAX_OUTCOMES 64
+
+struct request
+{
+    struct capture_record rec;
+    char *addr;
+    char *query;
+    char *body;
+};
+
+struct job
+{
+    pid_t pid;
+    int fd;
+    uint64_t start_ns;
+    size_t output_len;
+    char output[REPLAY_OUTPUT_LEN];
+};
+
+struct outcome
+{
+    char label[48];
+    uint64_t count;
+};
+
+static const char *cgi_dir = ".";
+static const char *directory_uri = NULL;
+
+/// The stand-in's password file, once written; removed at exit
+static char password_path[4096];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s -d <uri> [-s <speed>] [-b <cgi dir>] [-p <password>] [-j <max jobs>] <log>\n",
+            argv0);
+    exit(2);
+}
+
+static int by_start(const void *a, const void *b)
+{
+    const struct request *x = a;
+    const struct request *y = b;
+    return x->rec.start_ns < y->rec.start_ns ? -1 : x->rec.start_ns > y->rec.start_ns;
+}
+
+/// @brief Read a whole capture log, sorted by start time (records are written as requests finish)
+static struct request *load(const char *log_path, size_t *count)
+{
+    FILE *log = fopen(log_path, "rb");
+    if (log == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\n", log_path);
+        exit(1);
+    }
+
+    static char addr[CAPTURE_FIELD_MAX + 1];
+    static char query[CAPTURE_FIELD_MAX + 1];
+    static char body[CAPTURE_FIELD_MAX + 1];
+
+    struct request *requests = NULL;
+    size_t n = 0;
+    size_t capacity = 0;
+    struct capture_record rec;
+    int status;
+
+    while ((status = capture_read(log, &rec, addr, query, body)) == 1)
+    {
+        if (n == capacity)
+        {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            struct request *grown = realloc(requests, capacity * sizeof(*requests));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+            requests = grown;
+        }
+
+        requests[n].rec = rec;
+        requests[n].addr = strdup(addr);
+        requests[n].query = strdup(query);
+        requests[n].body = strdup(body);
+        if (requests[n].addr == NULL || requests[n].query == NULL || requests[n].body == NULL)
+        {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+        n++;
+    }
+
+    if (status < 0)
+    {
+        fprintf(stderr, "Stopped at a corrupt record after %zu requests\n", n);
+    }
+    fclose(log);
+
+    qsort(requests, n, sizeof(*requests), by_start);
+    *count = n;
+    return requests;
+}
+
+/// @brief Copy form data, pointing its server parameter at directory_uri if one was given
+static void retarget(char *dst, size_t dst_size, const char *data)
+{
+    snprintf(dst, dst_size, "%s", data);
+    if (directory_uri == NULL)
+    {
+        return;
+    }
+
+    size_t len;
+    char *value = form_param(dst, "server", &len);
+    if (value == NULL)
+    {
+        return;
+    }
+
+    // The separator may arrive as '+' or %2B, so find it in the decoded value
+    char decoded[CAPTURE_FIELD_MAX + 1];
+    percent_decode(decoded, value, len < CAPTURE_FIELD_MAX ? len : CAPTURE_FIELD_MAX);
+    char *base = strchr(decoded, '+');
+    if (base == NULL)
+    {
+        return;
+    }
+
+    char uri[1024];
+    char encoded_base[CAPTURE_FIELD_MAX * 3];
+    if (percent_encode(uri, sizeof(uri), directory_uri) != 0 ||
+        percent_encode(encoded_base, sizeof(encoded_base), base + 1) != 0)
+    {
+        return;
+    }
+
+    // "<before>server=" + uri + "%2B" + base + "<after>"
+    char *after = strdup(value + len);
+    if (after == NULL)
+    {
+        return;
+    }
+    size_t prefix = (size_t)(value - dst);
+    snprintf(dst + prefix, dst_size - prefix, "%s%%2B%s%s", uri, encoded_base, after);
+    free(after);
+}
+
+/// @brief Whether the cgi directory holds any dot file: a token, or a live install's config
+static int has_dot_files(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\n", dir);
+        exit(1);
+    }
+
+    int found = 0;
+    struct dirent *entry;
+    while (!found && (entry = readdir(d)) != NULL)
+    {
+        const char *name = entry->d_name;
+        found = name[0] == '.' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+    }
+    closedir(d);
+    return found;
+}
+
+static void remove_password(void)
+{
+    unlink(password_path);
+}
+
+/// @brief Write the stand-in directory's service account password where the cgi programs look
+static void write_password(const char *password)
+{
+    snprintf(password_path, sizeof(password_path), "%s/%s", cgi_dir, REPLAY_PASSWORD_FILE);
+    FILE *file = fopen(password_path, "wx");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to create %s\n", password_path);
+        exit(1);
+    }
+    fprintf(file, "%s\n", password);
+    fclose(file);
+    atexit(remove_password);
+}
+
+/// @brief Write .<username> with the (redacted) token, so set-password gets past its token check
+static void plant_token(const char *query)
+{
+    char data[CAPTURE_FIELD_MAX + 1];
+    snprintf(data, sizeof(data), "%s", query);
+
+    size_t token_len, username_len;
+    char *token = form_param(data, "token", &token_len);
+    char *username = form_param(data, "username", &username_len);
+    if (token == NULL || username == NULL || memchr(username, '/', username_len) != NULL)
+    {
+        return;
+    }
+    token[token_len] = 0;
+    username[username_len] = 0;
+
+    char filename[CAPTURE_FIELD_MAX + 64];
+    snprintf(filename, sizeof(filename), "%s/.%s", cgi_dir, username);
+    FILE *file = fopen(filename, "w");
+    if (file != NULL)
+    {
+        fprintf(file, "Subject: Password reset\n\n%s\n", token);
+        fclose(file);
+    }
+}
+
+/// @brief Start one captured request as a CGI process
+/// @return 0, or -1 if it couldn't be started
+static int start(const struct request *request, struct job *job)
+{
+    static char query[CAPTURE_FIELD_MAX * 2];
+    static char body[CAPTURE_FIELD_MAX * 2];
+    retarget(query, sizeof(query), request->query);
+    retarget(body, sizeof(body), request->body);
+
+    const char *program = request->rec.mode == CAPTURE_SET_PASSWORD ? "set-password" : "email-user";
+    if (request->rec.mode == CAPTURE_SET_PASSWORD)
+    {
+        plant_token(query);
+    }
+
+    int out[2];
+    int in[2];
+    if (pipe(out) != 0)
+    {
+        return -1;
+    }
+    if (pipe(in) != 0)
+    {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+
+    job->start_ns = now_ns();
+    job->output_len = 0;
+    job->output[0] = 0;
+    job->pid = fork();
+    if (job->pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+
+        char content_length[32];
+        snprintf(content_length, sizeof(content_length), "%zu", strlen(body));
+        setenv("CONTENT_LENGTH", content_length, 1);
+        setenv("QUERY_STRING", query, 1);
+        setenv("REMOTE_ADDR", request->addr, 1);
+        setenv("REQUEST_METHOD", request->rec.mode == CAPTURE_SET_PASSWORD ? "GET" : "POST", 1);
+        setenv("CPWD_SENDMAIL", REPLAY_SENDMAIL, 1);
+
+        if (chdir(cgi_dir) != 0)
+        {
+            _exit(126);
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "./%s", program);
+        execl(path, program, (char *)NULL);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    if (job->pid < 0)
+    {
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
+
+    // Bodies are far smaller than a pipe buffer, so this doesn't block
+    size_t len = strlen(body);
+    ssize_t written = write(in[1], body, len);
+    (void)written;
+    close(in[1]);
+
+    job->fd = out[0];
+    return 0;
+}
+
+static void count_outcome(struct outcome *outcomes, size_t *n, const char *label)
+{
+    for (size_t i = 0; i < *n; i++)
+    {
+        if (strcmp(outcomes[i].label, label) == 0)
+        {
+            outcomes[i].count++;
+            return;
+        }
+    }
+    if (*n < REPLAY_MAX_OUTCOMES)
+    {
+        snprintf(outcomes[*n].label, sizeof(outcomes[*n].label), "%s", label);
+        outcomes[(*n)++].count = 1;
+    }
+}
+
+/// @brief Describe how a finished request ended, from its output and exit status
+static void classify(const struct job *job, int wstatus, char *label, size_t label_size)
+{
+    const char *fail = strstr(job->output, "FAIL! Exit code: ");
+    if (fail != NULL)
+    {
+        snprintf(label, label_size, "fail %d", atoi(fail + strlen("FAIL! Exit code: ")));
+    }
+    else if (WIFSIGNALED(wstatus))
+    {
+        snprintf(label, label_size, "signal %d", WTERMSIG(wstatus));
+    }
+    else if (WEXITSTATUS(wstatus) != 0)
+    {
+        snprintf(label, label_size, "exit %d", WEXITSTATUS(wstatus));
+    }
+    else
+    {
+        snprintf(label, label_size, "ok");
+    }
+}
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, double p)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    size_t i = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+    return sorted[i];
+}
+
+/// @param n Requests that ran, whose latencies are given
+/// @param not_started Requests that couldn't be started; counted among the outcomes only
+static void report(double *latencies, size_t n, size_t not_started, const struct request *requests, size_t count,
+                   struct outcome *outcomes, size_t n_outcomes, double speed, double elapsed_s)
+{
+    qsort(latencies, n, sizeof(*latencies), by_value);
+
+    double *captured = malloc(sizeof(double) * (count == 0 ? 1 : count));
+    if (captured == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        captured[i] = (double)requests[i].rec.duration_us / 1000.0;
+    }
+    qsort(captured, count, sizeof(*captured), by_value);
+
+    printf("replayed %zu requests at %gx in %.2fs (%.1f req/s), %zu not started\n",
+           n, speed, elapsed_s, elapsed_s > 0 ? (double)n / elapsed_s : 0.0, not_started);
+    printf("latency ms:  p50 %-9.1f p90 %-9.1f p99 %-9.1f max %.1f\n",
+           percentile(latencies, n, 50), percentile(latencies, n, 90), percentile(latencies, n, 99),
+           n == 0 ? 0.0 : latencies[n - 1]);
+    printf("captured ms: p50 %-9.1f p90 %-9.1f p99 %-9.1f max %.1f\n",
+           percentile(captured, count, 50), percentile(captured, count, 90), percentile(captured, count, 99),
+           count == 0 ? 0.0 : captured[count - 1]);
+    free(captured);
+
+    uint64_t hist[REPLAY_HIST_BUCKETS] = {0};
+    for (size_t i = 0; i < n; i++)
+    {
+        int bucket = 0;
+        while (bucket < REPLAY_HIST_BUCKETS - 1 && latencies[i] >= (double)(1u << bucket))
+        {
+            bucket++;
+        }
+        hist[bucket]++;
+    }
+
+    printf("\nlatency distribution:\n");
+    for (int b = 0; b < REPLAY_HIST_BUCKETS; b++)
+    {
+        if (hist[b] == 0)
+        {
+            continue;
+        }
+        int width = (int)(hist[b] * 50 / (n == 0 ? 1 : n));
+        printf("  < %6ums %8llu %5.1f%% %.*s\n",
+               1u << b,
+               (unsigned long long)hist[b],
+               100.0 * (double)hist[b] / (double)n,
+               width,
+               "##################################################");
+    }
+
+    printf("\noutcomes:\n");
+    for (size_t i = 0; i < n_outcomes; i++)
+    {
+        printf("  %-12s %8llu %5.1f%%\n",
+               outcomes[i].label,
+               (unsigned long long)outcomes[i].count,
+               100.0 * (double)outcomes[i].count / (double)(n + not_started == 0 ? 1 : n + not_started));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+    long max_jobs = REPLAY_DEFAULT_JOBS;
+    const char *password = REPLAY_PASSWORD;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:b:p:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'd':
+            directory_uri = optarg;
+            break;
+        case 'b':
+            cgi_dir = optarg;
+            break;
+        case 'p':
+            password = optarg;
+            break;
+        case 'j':
+            max_jobs = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || speed <= 0 || max_jobs <= 0)
+    {
+        usage(argv[0]);
+    }
+
+    if (directory_uri == NULL)
+    {
+        fprintf(stderr, "A stand-in directory (-d) is required; a replay must never reach the captured servers\n");
+        usage(argv[0]);
+    }
+    if (has_dot_files(cgi_dir))
+    {
+        fprintf(stderr, "%s holds tokens or a live install's config; replay into a scratch directory instead\n",
+                cgi_dir);
+        return 1;
+    }
+    write_password(password);
+
+    // Keep replayed requests out of the live server's slots, cache, coalescing and planner
+    const char *shm_prefix = getenv("CPWD_SHM_PREFIX");
+    if (shm_prefix == NULL || *shm_prefix == 0)
+    {
+        setenv("CPWD_SHM_PREFIX", REPLAY_SHM_PREFIX, 1);
+    }
+
+    size_t count;
+    struct request *requests = load(argv[optind], &count);
+    struct job *jobs = calloc((size_t)max_jobs, sizeof(*jobs));
+    struct pollfd *fds = calloc((size_t)max_jobs, sizeof(*fds));
+    double *latencies = malloc(sizeof(double) * (count == 0 ? 1 : count));
+    if (jobs == NULL || fds == NULL || latencies == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    struct outcome outcomes[REPLAY_MAX_OUTCOMES];
+    size_t n_outcomes = 0;
+    size_t finished = 0;
+    size_t not_started = 0;
+    size_t next = 0;
+    long running = 0;
+    uint64_t began = now_ns();
+
+    while (next < count || running > 0)
+    {
+        // Start everything that's due
+        long wait_ms = -1;
+        while (next < count && running < max_jobs)
+        {
+            uint64_t offset = (uint64_t)((double)(requests[next].rec.start_ns - requests[0].rec.start_ns) / speed);
+            uint64_t now = now_ns();
+            if (began + offset > now)
+            {
+                wait_ms = (long)((began + offset - now) / 1000000ULL) + 1;
+                break;
+            }
+
+            if (start(&requests[next], &jobs[running]) == 0)
+            {
+                running++;
+            }
+            else
+            {
+                // An error, not a latency: it never reached the cgi program
+                count_outcome(outcomes, &n_outcomes, "not started");
+                not_started++;
+            }
+            next++;
+        }
+
+        for (long j = 0; j < running; j++)
+        {
+            fds[j] = (struct pollfd){.fd = jobs[j].fd, .events = POLLIN};
+        }
+        if (poll(fds, (nfds_t)running, (int)wait_ms) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return 1;
+        }
+
+        for (long j = running - 1; j >= 0; j--)
+        {
+            if (fds[j].revents == 0)
+            {
+                continue;
+            }
+
+            struct job *job = &jobs[j];
+            char buf[1024];
+            ssize_t got = read(job->fd, buf, sizeof(buf));
+            if (got > 0)
+            {
+                size_t room = REPLAY_OUTPUT_LEN - 1 - job->output_len;
+                size_t keep = (size_t)got < room ? (size_t)got : room;
+                memcpy(job->output + job->output_len, buf, keep);
+                job->output_len += keep;
+                job->output[job->output_len] = 0;
+                continue;
+            }
+
+            // EOF: the request is done
+            int wstatus = 0;
+            close(job->fd);
+            waitpid(job->pid, &wstatus, 0);
+            latencies[finished++] = (double)(now_ns() - job->start_ns) / 1e6;
+
+            char label[48];
+            classify(job, wstatus, label, sizeof(label));
+            count_outcome(outcomes, &n_outcomes, label);
+
+            jobs[j] = jobs[--running];
+        }
+    }
+
+    report(latencies, finished, not_started, requests, count, outcomes, n_outcomes, speed,
+           (double)(now_ns() - began) / 1e9);
+    return 0;
+}
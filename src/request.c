@@ -0,0 +1,149 @@
+#include <string.h>
+
+#include "request.h"
+
+char *form_param(char *data, const char *name, size_t *value_len)
+{
+    size_t name_len = strlen(name);
+    char *p = data;
+
+    while (p != NULL && *p != 0)
+    {
+        // Only match at the start of a field, so "userid" doesn't match "xuserid="
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=')
+        {
+            char *value = p + name_len + 1;
+            char *end = strchr(value, '&');
+            *value_len = end == NULL ? strlen(value) : (size_t)(end - value);
+            return value;
+        }
+
+        p = strchr(p, '&');
+        if (p != NULL)
+        {
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+/// @brief Value of a single hex digit, or -1
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+size_t percent_decode(char *dst, const char *src, size_t len)
+{
+    size_t out = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (src[i] == '%' && i + 2 < len)
+        {
+            int hi = hex_value(src[i + 1]);
+            int lo = hex_value(src[i + 2]);
+            if (hi >= 0 && lo >= 0)
+            {
+                dst[out++] = (char)(hi << 4 | lo);
+                i += 2;
+                continue;
+            }
+        }
+        dst[out++] = src[i];
+    }
+
+    dst[out] = 0;
+    return out;
+}
+
+int percent_encode(char *dst, size_t dst_size, const char *src)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t out = 0;
+
+    for (const char *p = src; *p != 0; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        int plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' ||
+                    c == '.' || c == '_' || c == '~';
+
+        if (out + (plain ? 1 : 3) >= dst_size)
+        {
+            return -1;
+        }
+        if (plain)
+        {
+            dst[out++] = (char)c;
+        }
+        else
+        {
+            dst[out++] = '%';
+            dst[out++] = hex[c >> 4];
+            dst[out++] = hex[c & 0xf];
+        }
+    }
+
+    if (dst_size == 0)
+    {
+        return -1;
+    }
+    dst[out] = 0;
+    return 0;
+}
+
+int user_filter(char *dst, size_t dst_size, const char *username)
+{
+    static const char prefix[] = "(SamAccountName=";
+    static const char hex[] = "0123456789abcdef";
+    size_t out = sizeof(prefix) - 1;
+
+    // Always leave room for the closing ')' and the NUL
+    if (dst_size < out + 2)
+    {
+        return -1;
+    }
+    memcpy(dst, prefix, out);
+
+    for (const char *p = username; *p != 0; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+
+        // RFC 4515: '*', '(', ')', '\' and NUL must be written as \XX
+        if (c == '*' || c == '(' || c == ')' || c == '\\')
+        {
+            if (out + 3 + 2 > dst_size)
+            {
+                return -1;
+            }
+            dst[out++] = '\\';
+            dst[out++] = hex[c >> 4];
+            dst[out++] = hex[c & 0xf];
+        }
+        else
+        {
+            if (out + 1 + 2 > dst_size)
+            {
+                return -1;
+            }
+            dst[out++] = (char)c;
+        }
+    }
+
+    dst[out++] = ')';
+    dst[out] = 0;
+    return 0;
+}
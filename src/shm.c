@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+/// Longest segment name, prefix included
+#define SHM_NAME_LEN 256
+
+/// How long to wait for another process to finish creating a segment
+#define SHM_INIT_WAIT_MS 100
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000L,
+    };
+    nanosleep(&ts, NULL);
+}
+
+/// @brief The name to open a segment under: the given one, or with CPWD_SHM_PREFIX in front
+/// @return 0, or -1 if the prefix makes the name unusable
+static int segment_name(char *dst, size_t dst_size, const char *name)
+{
+    const char *prefix = getenv("CPWD_SHM_PREFIX");
+    int len;
+    if (prefix == NULL || *prefix == 0)
+    {
+        len = snprintf(dst, dst_size, "%s", name);
+    }
+    else if (strchr(prefix, '/') != NULL)
+    {
+        return -1;
+    }
+    else
+    {
+        len = snprintf(dst, dst_size, "/%s.%s", prefix, name + 1);
+    }
+    return len > 0 && (size_t)len < dst_size ? 0 : -1;
+}
+
+/// @brief Wait until the creator has set the magic number
+/// @return 0 if the segment has the expected layout, -1 otherwise
+static int wait_for_magic(const struct shm_header *header, size_t size, uint32_t magic)
+{
+    for (int waited = 0; waited <= SHM_INIT_WAIT_MS; waited++)
+    {
+        if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == magic)
+        {
+            return header->size == size ? 0 : -1;
+        }
+        sleep_ms(1);
+    }
+    return -1;
+}
+
+/// @brief Wait until the creator has sized the segment
+/// @return 0 if the segment is the expected size, -1 otherwise
+static int wait_for_size(int fd, size_t size)
+{
+    struct stat st;
+    for (int waited = 0; waited <= SHM_INIT_WAIT_MS; waited++)
+    {
+        if (fstat(fd, &st) != 0)
+        {
+            return -1;
+        }
+        if (st.st_size != 0)
+        {
+            return (size_t)st.st_size == size ? 0 : -1;
+        }
+        sleep_ms(1);
+    }
+    return -1;
+}
+
+/// @brief Map a segment by its full name, creating it if it doesn't exist
+/// @param unusable Set to 1 if a segment exists but has another layout (or its creator died
+///  before finishing it)
+static void *attach_path(const char *path, size_t size, uint32_t magic, void (*init)(void *segment), int *unusable)
+{
+    // Try to create it first, so exactly one process runs init()
+    int created = 1;
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = 0;
+        fd = shm_open(path, O_RDWR, 0600);
+    }
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (created ? ftruncate(fd, size) != 0 : wait_for_size(fd, size) != 0)
+    {
+        *unusable = !created;
+        close(fd);
+        return NULL;
+    }
+
+    void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    struct shm_header *header = segment;
+    if (created)
+    {
+        // ftruncate() zero-fills, so init() only has to set what isn't zero
+        header->size = size;
+        if (init != NULL)
+        {
+            init(segment);
+        }
+        __atomic_store_n(&header->magic, magic, __ATOMIC_RELEASE);
+    }
+    else if (wait_for_magic(header, size, magic) != 0)
+    {
+        *unusable = 1;
+        munmap(segment, size);
+        return NULL;
+    }
+
+    return segment;
+}
+
+void *shm_attach(const char *name, size_t size, uint32_t magic, void (*init)(void *segment))
+{
+    char path[SHM_NAME_LEN];
+    if (segment_name(path, sizeof(path), name) != 0)
+    {
+        return NULL;
+    }
+
+    int unusable = 0;
+    void *segment = attach_path(path, size, magic, init, &unusable);
+    if (segment == NULL && unusable)
+    {
+        // Left by an older build, or by a creator that was killed; it only ever holds what
+        //  can be rebuilt, so start it afresh. Processes still mapping the old one keep it.
+        fprintf(stderr, "crappasswd: recreating shared memory segment %s, which has another layout\n", path);
+        shm_unlink(path);
+        segment = attach_path(path, size, magic, init, &unusable);
+    }
+    return segment;
+}
+
+void shm_wait(uint32_t *word, uint32_t seen, long timeout_ms)
+{
+    // A shared (not private) futex, since the word is mapped by many processes
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+}
+
+void shm_wake(uint32_t *word)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+uint64_t shm_key(const char *s)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *s != 0; s++)
+    {
+        hash ^= (unsigned char)*s;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+const void *shm_attach_readonly(const char *name, size_t size, uint32_t magic)
+{
+    char path[SHM_NAME_LEN];
+    if (segment_name(path, sizeof(path), name) != 0)
+    {
+        return NULL;
+    }
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (wait_for_size(fd, size) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *segment = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if (wait_for_magic(segment, size, magic) != 0)
+    {
+        munmap(segment, size);
+        return NULL;
+    }
+
+    return segment;
+}
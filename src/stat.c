@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cache.h"
+#include "dirsched.h"
+#include "flight.h"
+#include "plan.h"
+#include "trace.h"
+
+// crappasswd_stat: inspect the shared memory state left behind by crappasswd requests.
+//  Doesn't link libldap, so it runs on the web host without the dev packages.
+//
+// Usage: crappasswd_stat trace [-n <count>] [-r <request id>]
+//        crappasswd_stat sched
+//        crappasswd_stat cache
+//        crappasswd_stat flight
+//        crappasswd_stat plan
+
+/// @brief Names for the LDAP result codes we actually see, so the dump tool doesn't need libldap
+static const char *ldap_code_name(int code)
+{
+    switch (code)
+    {
+    case 0:
+        return "success";
+    case 3:
+        return "timeLimitExceeded";
+    case 4:
+        return "sizeLimitExceeded";
+    case 32:
+        return "noSuchObject";
+    case 49:
+        return "invalidCredentials";
+    case 50:
+        return "insufficientAccessRights";
+    case 51:
+        return "busy";
+    case 52:
+        return "unavailable";
+    case 53:
+        return "unwillingToPerform";
+    case -1:
+        return "serverDown";
+    case -5:
+        return "timeout";
+    case -7:
+        return "filterError";
+    case -11:
+        return "connectError";
+    default:
+        return "";
+    }
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s trace [-n <count>] [-r <request id>]\n", argv0);
+    fprintf(stderr, "       %s sched\n", argv0);
+    fprintf(stderr, "       %s cache\n", argv0);
+    fprintf(stderr, "       %s flight\n", argv0);
+    fprintf(stderr, "       %s plan\n", argv0);
+    exit(2);
+}
+
+static int dump_trace(int argc, char **argv)
+{
+    size_t count = 100;
+    uint64_t only_request = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            count = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            only_request = strtoull(argv[++i], NULL, 10);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    const struct trace_ring *ring = shm_attach_readonly(TRACE_SHM_NAME, sizeof(struct trace_ring), TRACE_MAGIC);
+    if (ring == NULL)
+    {
+        fprintf(stderr, "No trace ring at %s\n", TRACE_SHM_NAME);
+        return 1;
+    }
+
+    struct trace_event *events = malloc(sizeof(struct trace_event) * TRACE_SLOTS);
+    if (events == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    size_t n = trace_snapshot(ring, events, TRACE_SLOTS);
+
+    // Only print the last `count` matching events
+    size_t matching = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        matching += only_request == 0 || events[i].request_id == only_request;
+    }
+
+    size_t skip = matching > count ? matching - count : 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct trace_event *e = &events[i];
+        if (only_request != 0 && e->request_id != only_request)
+        {
+            continue;
+        }
+        if (skip > 0)
+        {
+            skip--;
+            continue;
+        }
+
+        // Time since the previous event of the same request, if it's still in the ring
+        double delta_ms = 0;
+        for (size_t j = i; j-- > 0;)
+        {
+            if (events[j].request_id == e->request_id)
+            {
+                delta_ms = (double)(e->timestamp_ns - events[j].timestamp_ns) / 1e6;
+                break;
+            }
+        }
+
+        time_t secs = (time_t)(e->timestamp_ns / 1000000000ULL);
+        struct tm tm;
+        char when[32];
+        gmtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+        printf("%s.%06luZ req=%-8llu pid=%-7u +%9.3fms %-7s result=%d %s server=%.*s\n",
+               when,
+               (unsigned long)(e->timestamp_ns % 1000000000ULL / 1000),
+               (unsigned long long)e->request_id,
+               e->pid,
+               delta_ms,
+               trace_phase_name(e->phase),
+               e->result,
+               ldap_code_name(e->result),
+               TRACE_SERVER_LEN,
+               e->server);
+    }
+
+    free(events);
+    return 0;
+}
+
+static int dump_sched(int argc, char **argv)
+{
+    (void)argv;
+    if (argc != 0)
+    {
+        return -1;
+    }
+
+    const struct sched_segment *seg = shm_attach_readonly(SCHED_SHM_NAME, sizeof(struct sched_segment), SCHED_MAGIC);
+    if (seg == NULL)
+    {
+        fprintf(stderr, "No scheduler state at %s\n", SCHED_SHM_NAME);
+        return 1;
+    }
+
+    // Read without the lock, so the numbers can be a request or two out of step
+    printf("slots: %u/%u in use, per-domain cap %u, max wait %ums\n",
+           seg->in_use, seg->slots, seg->domain_cap, seg->wait_ms);
+    printf("%-8s %-8s %-8s %-10s %-10s %-12s %-12s %s\n",
+           "running", "queued", "served", "rejected", "svc_ms", "avg_wait_ms", "max_wait_ms", "target");
+
+    for (int d = 0; d < SCHED_DOMAINS; d++)
+    {
+        const struct sched_domain *domain = &seg->domains[d];
+        if (domain->key == 0)
+        {
+            continue;
+        }
+
+        double avg_wait = domain->served == 0 ? 0 : (double)domain->wait_total_ns / (double)domain->served / 1e6;
+        printf("%-8u %-8u %-8llu %-10llu %-10u %-12.1f %-12.1f %.*s\n",
+               domain->in_flight,
+               domain->queued,
+               (unsigned long long)domain->served,
+               (unsigned long long)domain->rejected,
+               domain->service_ms,
+               avg_wait,
+               (double)domain->wait_max_ns / 1e6,
+               SCHED_NAME_LEN,
+               domain->name);
+    }
+
+    return 0;
+}
+
+static int dump_cache(int argc, char **argv)
+{
+    (void)argv;
+    if (argc != 0)
+    {
+        return -1;
+    }
+
+    const struct cache_segment *seg = shm_attach_readonly(CACHE_SHM_NAME, sizeof(struct cache_segment), CACHE_MAGIC);
+    if (seg == NULL)
+    {
+        fprintf(stderr, "No cache at %s\n", CACHE_SHM_NAME);
+        return 1;
+    }
+
+    static const char *kind_names[CACHE_KIND_COUNT] = {
+        [CACHE_SECRET] = "secret",
+        [CACHE_USER] = "user",
+        [CACHE_HEALTH] = "health",
+        [CACHE_MISS] = "miss",
+    };
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec;
+
+    uint32_t live[CACHE_KIND_COUNT] = {0};
+    for (int i = 0; i < CACHE_SLOTS; i++)
+    {
+        const struct cache_slot *slot = &seg->slots[i];
+        if (slot->key != 0 && slot->expires > now && slot->kind < CACHE_KIND_COUNT)
+        {
+            live[slot->kind]++;
+        }
+    }
+
+    printf("%-8s %-8s %-10s %-10s %s\n", "kind", "live", "hits", "misses", "hit_rate");
+    for (int k = 0; k < CACHE_KIND_COUNT; k++)
+    {
+        uint64_t lookups = seg->hits[k] + seg->misses[k];
+        printf("%-8s %-8u %-10llu %-10llu %.1f%%\n",
+               kind_names[k],
+               live[k],
+               (unsigned long long)seg->hits[k],
+               (unsigned long long)seg->misses[k],
+               lookups == 0 ? 0.0 : 100.0 * (double)seg->hits[k] / (double)lookups);
+    }
+
+    // Health entries hold the server's uri, so list the ones we're currently skipping
+    for (int i = 0; i < CACHE_SLOTS; i++)
+    {
+        const struct cache_slot *slot = &seg->slots[i];
+        if (slot->kind == CACHE_HEALTH && slot->key != 0 && slot->expires > now)
+        {
+            printf("down for %llus: %.*s\n",
+                   (unsigned long long)(slot->expires - now),
+                   (int)strnlen(slot->value, CACHE_VALUE_LEN),
+                   slot->value);
+        }
+    }
+
+    return 0;
+}
+
+static int dump_flight(int argc, char **argv)
+{
+    (void)argv;
+    if (argc != 0)
+    {
+        return -1;
+    }
+
+    const struct flight_segment *seg =
+        shm_attach_readonly(FLIGHT_SHM_NAME, sizeof(struct flight_segment), FLIGHT_MAGIC);
+    if (seg == NULL)
+    {
+        fprintf(stderr, "No coalescing state at %s\n", FLIGHT_SHM_NAME);
+        return 1;
+    }
+
+    printf("led %llu, joined %llu, reused %llu (window %us)\n",
+           (unsigned long long)seg->led,
+           (unsigned long long)seg->joined,
+           (unsigned long long)seg->reused,
+           seg->window_s);
+    printf("saved %llu directory searches, %llu mails\n",
+           (unsigned long long)seg->searches_saved,
+           (unsigned long long)seg->mails_saved);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec;
+
+    for (int i = 0; i < FLIGHT_SLOTS; i++)
+    {
+        const struct flight_entry *entry = &seg->entries[i];
+        if (entry->state == FLIGHT_RUNNING)
+        {
+            printf("running  pid=%-7u %.*s\n", (unsigned)entry->owner, FLIGHT_EMAIL_LEN, entry->email);
+        }
+        else if (entry->state == FLIGHT_DONE && entry->done_s + seg->window_s > now)
+        {
+            printf("reusable %llus left %.*s\n",
+                   (unsigned long long)(entry->done_s + seg->window_s - now),
+                   FLIGHT_EMAIL_LEN,
+                   entry->email);
+        }
+    }
+
+    return 0;
+}
+
+static int dump_plan(int argc, char **argv)
+{
+    (void)argv;
+    if (argc != 0)
+    {
+        return -1;
+    }
+
+    const struct plan_segment *seg = shm_attach_readonly(PLAN_SHM_NAME, sizeof(struct plan_segment), PLAN_MAGIC);
+    if (seg == NULL)
+    {
+        fprintf(stderr, "No search planner state at %s\n", PLAN_SHM_NAME);
+        return 1;
+    }
+
+    for (int i = 0; i < PLAN_TARGETS; i++)
+    {
+        const struct plan_target *t = &seg->targets[i];
+        if (t->key == 0)
+        {
+            continue;
+        }
+
+        printf("%.*s\n", PLAN_NAME_LEN, t->name);
+        printf("  %-16s %-8s %-8s %-9s %-8s %s\n", "strategy", "tries", "hits", "hit_rate", "avg_ms", "skipped");
+        for (int s = 0; s < PLAN_STRATEGY_COUNT; s++)
+        {
+            const struct plan_stats *stats = &t->stats[s];
+            printf("  %-16s %-8llu %-8llu %7.1f%%  %-8.1f %llu\n",
+                   plan_strategy_name(s),
+                   (unsigned long long)stats->tries,
+                   (unsigned long long)stats->hits,
+                   stats->tries == 0 ? 0.0 : 100.0 * (double)stats->hits / (double)stats->tries,
+                   stats->tries == 0 ? 0.0 : (double)stats->total_ms / (double)stats->tries,
+                   (unsigned long long)stats->skipped);
+        }
+        for (int c = 0; c < PLAN_CONTAINERS; c++)
+        {
+            if (t->containers[c].hits > 0)
+            {
+                printf("  container %-6u %.*s\n", t->containers[c].hits, PLAN_DN_LEN, t->containers[c].dn);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+    }
+
+    int status = -1;
+    if (strcmp(argv[1], "trace") == 0)
+    {
+        status = dump_trace(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "sched") == 0)
+    {
+        status = dump_sched(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "cache") == 0)
+    {
+        status = dump_cache(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "flight") == 0)
+    {
+        status = dump_flight(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "plan") == 0)
+    {
+        status = dump_plan(argc - 2, argv + 2);
+    }
+
+    if (status < 0)
+    {
+        usage(argv[0]);
+    }
+    return status;
+}
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/// The ring, or NULL when tracing is off
+static struct trace_ring *ring;
+
+static uint64_t request_id;
+
+static char server[TRACE_SERVER_LEN];
+
+static const char *phase_names[TRACE_PHASE_COUNT] = {
+    [TRACE_START] = "start",
+    [TRACE_PARSED] = "parsed",
+    [TRACE_BIND] = "bind",
+    [TRACE_SEARCH] = "search",
+    [TRACE_VERIFY] = "verify",
+    [TRACE_UNBIND] = "unbind",
+    [TRACE_MAIL] = "mail",
+    [TRACE_TOKEN] = "token",
+    [TRACE_MODIFY] = "modify",
+    [TRACE_DONE] = "done",
+    [TRACE_FAIL] = "fail",
+    [TRACE_QUEUE] = "queue",
+    [TRACE_HEDGE] = "hedge",
+    [TRACE_CACHE] = "cache",
+    [TRACE_COALESCE] = "coalesce",
+    [TRACE_FANOUT] = "fanout",
+};
+
+void trace_open(void)
+{
+    const char *enabled = getenv("CPWD_TRACE");
+    if (enabled != NULL && strcmp(enabled, "0") == 0)
+    {
+        return;
+    }
+
+    ring = shm_attach(TRACE_SHM_NAME, sizeof(struct trace_ring), TRACE_MAGIC, NULL);
+    if (ring != NULL)
+    {
+        request_id = __atomic_add_fetch(&ring->next_request_id, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void trace_server(const char *name)
+{
+    strncpy(server, name, TRACE_SERVER_LEN - 1);
+}
+
+void trace(enum trace_phase phase, int result)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    struct trace_event *event = &ring->events[pos % TRACE_SLOTS];
+
+    // Odd while we're writing, so readers skip the slot
+    __atomic_store_n(&event->seq, pos * 2 + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    event->request_id = request_id;
+    event->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    event->pid = (uint32_t)getpid();
+    event->phase = phase;
+    event->result = result;
+    memcpy(event->server, server, TRACE_SERVER_LEN);
+
+    __atomic_store_n(&event->seq, pos * 2 + 2, __ATOMIC_RELEASE);
+}
+
+const char *trace_phase_name(uint32_t phase)
+{
+    return phase < TRACE_PHASE_COUNT ? phase_names[phase] : "?";
+}
+
+size_t trace_snapshot(const struct trace_ring *ring, struct trace_event *out, size_t max)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t count = head < TRACE_SLOTS ? head : TRACE_SLOTS;
+    if (count > max)
+    {
+        count = max;
+    }
+
+    size_t n = 0;
+    for (uint64_t pos = head - count; pos < head; pos++)
+    {
+        const struct trace_event *event = &ring->events[pos % TRACE_SLOTS];
+
+        uint64_t before = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+        memcpy(&out[n], event, sizeof(*event));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t after = __atomic_load_n(&event->seq, __ATOMIC_RELAXED);
+
+        // Skip slots that are mid-write or were lapped while we copied them
+        if (before == after && before == pos * 2 + 2)
+        {
+            n++;
+        }
+    }
+
+    return n;
+}